@@ -1,22 +1,55 @@
+#define _GNU_SOURCE	/* pthread_getattr_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>	/* malloc_trim */
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /*
  * arena is 64K naturally aligned. allocation unit is 16B.
  * due to natural alignment, if you have a ptr *into* an arena,
  * you can recover the arena ptr itself by just masking the low
  * 16 bits.
+ *
+ * both sizes are log2s, which can be set on the command line
+ * (-DARENA_LOG2=20 for 1M arenas, say), and everything else is
+ * worked out from them.
  */
 
-#define ARENA_SIZE (64*1024)
-#define ALLOC_UNIT (16)
-/* TODO: 32/64 */
-#define GS_SIZE (510)
+#ifndef ARENA_LOG2
+#define ARENA_LOG2 (16)
+#endif
+#ifndef UNIT_LOG2
+#define UNIT_LOG2 (4)
+#endif
+
+#define ARENA_SIZE (1 << ARENA_LOG2)
+#define ALLOC_UNIT (1 << UNIT_LOG2)
+
+/* a gs chunk is a page: its count and link, and the rest ptrs */
+#define GS_BYTES (4096)
+#define GS_SIZE ((int)((GS_BYTES - 2 * sizeof(void *)) / sizeof(void *)))
 
 #define __noreturn __attribute__((noreturn))
 #define __pure __attribute__((pure))
+/* for code which reads memory it doesn't own, like stack scanning */
+#define __noasan __attribute__((no_sanitize_address))
 
 void __noreturn die(int exitcode, char const * p, ...) {
 	va_list vl;
@@ -33,195 +66,5710 @@ struct obj {
 	unsigned char type:7;
 };
 
+/* obj.type is 7 bits */
+#define NUM_TYPES (128)
+
 /* because the used/mark arrays are at the start of the arena, 
  * we don't actually allocate the first N allocation units. this
  * allows the corresponding bits in the free/mark arrays to be
  * reused for other metadata.
  *
+ * N is ARENA_HDR_UNITS. it has to cover the whole of struct arena,
+ * and leave 16 bytes worth of bits at the front of each array. it is
+ * struct arena's size in units, rounded up to a whole bitmap word and
+ * at least those 128 bits. for 64K arenas of 16B units, that is 192:
+ * the four bitmaps alone would fill 128.
+ *
  * these structs contain that metadata, and must not grow larger
  * than 16 bytes each.
  */
+#define ARENA_HDR_UNITS ((int)(sizeof(struct arena) <= 128 * ALLOC_UNIT ? 128\
+	: (sizeof(struct arena) + WORD_BITS * ALLOC_UNIT - 1)\
+	/ (WORD_BITS * ALLOC_UNIT) * WORD_BITS))
+
+/* bitmaps are arrays of machine words, so they can be scanned a word at
+ * a time */
+typedef unsigned long word_t;
+#define WORD_BITS (8 * sizeof(word_t))
+
 struct arena_meta_a { int nextcell; struct gs * gs; };
-struct arena_meta_b { int dummy; };
+struct arena_meta_b { int ongray; struct arena * graynext; };
+
+/* the rest of the metadata lives after the bitmaps, in header cells
+ * that nothing else uses */
+/* small objects of up to this many units come from per-arena free lists
+ * of exactly that size */
+#define SIZE_CLASSES (8)
+
+/* the remembered set is a byte per card of this many cells, dirtied by the
+ * barrier when an old object in the card is written */
+#define CARD_CELLS (32)
+
+enum arena_kind {
+	ARENA_SMALL,	/* cells allocated from the bitmaps */
+	ARENA_LARGE,	/* a single large object, in its own mapping */
+	ARENA_TINY,	/* cells of one tiny type, without headers */
+};
+
+struct arena_meta_c {
+	enum arena_kind kind;
+	size_t mapsize;		/* bytes mapped, for large objects */
+	struct arena * next;	/* all arenas of this kind */
+	struct arena * freenext;	/* arenas with room */
+	int onfree;
+	unsigned swept;		/* gc.epoch when this arena was last swept */
+	unsigned fl[SIZE_CLASSES];	/* first cell of each free list */
+	unsigned flmask;	/* bit n-1 set if list n is nonempty */
+	int nobig;		/* no free runs longer than SIZE_CLASSES */
+	int owned;		/* a thread's own arena to allocate from */
+	int young;		/* in the nursery */
+	struct arena * nursenext;
+	int dirty;		/* has dirty cards */
+	struct arena * dirtynext;
+	int hasold;		/* has any old bits set */
+	int evacuating;		/* being emptied, and freed after marking */
+	int scavenged;		/* empty, and about to be given back */
+	int mapped;		/* from a snapshot, so unmapped when freed */
+	int pristine;		/* mapped, and its free cells not written yet */
+	int type, units;	/* of every object in a tiny arena */
+	unsigned long stride;	/* their first cells' bits in a bitmap word */
+	unsigned char cards[ARENA_SIZE / ALLOC_UNIT / CARD_CELLS];
+};
 
 /* if sizeof(sym) > c, then fails build with -ve array size */
 #define CHECK_NOT_BIGGER_THAN(sym, c) \
 	int sym##____too_big[ (c) - (int)sizeof( struct sym ) ]
 
-struct check_sizes {
-	CHECK_NOT_BIGGER_THAN( arena_meta_a, 16 );
-	CHECK_NOT_BIGGER_THAN( arena_meta_b, 16 );
-};
+#define ARENA_CELLS (ARENA_SIZE / ALLOC_UNIT)
+#define ARENA_WORDS (ARENA_CELLS / WORD_BITS)
 
 struct arena {
 	union {
-		int used[ARENA_SIZE / ALLOC_UNIT / sizeof(int) / 8];
+		word_t used[ARENA_WORDS];
 		struct arena_meta_a a;
 	};
 	union {
-		int mark[ARENA_SIZE / ALLOC_UNIT / sizeof(int) / 8];
+		word_t mark[ARENA_WORDS];
 		struct arena_meta_b b;
 	};
-	/* 64K - sizeof(struct arena) of data follows */
+	word_t old[ARENA_WORDS];	/* first cells of old objects */
+	word_t starts[ARENA_WORDS];	/* first cells of all objects */
+	struct arena_meta_c c;
+	/* ARENA_SIZE - ARENA_HDR_UNITS * ALLOC_UNIT of data follows */
 };
 
-struct arena * arena_new(void) {
-	struct arena * a = 0;
-	if (posix_memalign( (void **) &a, ARENA_SIZE, ARENA_SIZE ))
-		die( 1, "arena allocation failed" );
+struct check_sizes {
+	CHECK_NOT_BIGGER_THAN( arena_meta_a, ARENA_HDR_UNITS / 8 );
+	CHECK_NOT_BIGGER_THAN( arena_meta_b, ARENA_HDR_UNITS / 8 );
+	/* evacuation leaves a forwarding ptr after the header of even the
+	 * smallest object */
+	int unit_too_small[ ALLOC_UNIT >= 2 * sizeof(void *) ? 1 : -1 ];
+};
 
-	memset( a, 0, sizeof(*a) );
-	a->a.nextcell = (sizeof(struct arena) + ALLOC_UNIT - 1) >> 4;
+#define CELL_OF(a,o)\
+	(((size_t)(o) - (size_t)(a)) >> UNIT_LOG2)
+#define BIT(c)\
+	((word_t)1 << ((c) % WORD_BITS))
+#define IS_USED(a,c)\
+	((a)->used[(c) / WORD_BITS] & BIT(c))
+#define IS_MARKED(a,c)\
+	((marks_of(a)[(c) / WORD_BITS] ^ gc.sense) & BIT(c))
+#define MARK(a,c)\
+	mark_cells((a), (c), 1)
+#define IS_OLD(a,c)\
+	((a)->old[(c) / WORD_BITS] & BIT(c))
+#define SET_OLD(a,cell)\
+	do { (a)->old[(cell) / WORD_BITS] |= BIT(cell); (a)->c.hasold = 1; } while(0)
 
-	return a;
+/* tiny arenas hold objects of a single fixed-size type, registered with
+ * type_register_tiny, which have no struct obj: the arena has their type,
+ * and a bitmap of their gray bits in the header cells after the usual
+ * ones. a tiny object is a power of two units, up to TINY_MAX_UNITS, and
+ * aligned to its size, so the first cells of objects are the same bits
+ * of every bitmap word. so a cons cell of two ptrs is one 16B unit,
+ * where with a header it would be two. */
+#define TINY_MAX_UNITS (8)
+#define TINY_GRAY_UNITS ((ARENA_WORDS * sizeof(word_t) + TINY_MAX_UNITS * ALLOC_UNIT - 1)\
+	/ (TINY_MAX_UNITS * ALLOC_UNIT) * TINY_MAX_UNITS)
+#define TINY_START (ARENA_HDR_UNITS + TINY_GRAY_UNITS)
+
+static inline word_t * grays_of(struct arena * a) {
+	return (word_t *)((size_t)a + ARENA_HDR_UNITS * ALLOC_UNIT);
 }
 
-struct obj * arena_alloc(struct arena * a, size_t objsize) {
-	if (objsize < sizeof(struct obj))
-		return 0; /* can't allocate less than a gc header */
+static inline int obj_type(struct arena * a, struct obj * o) {
+	return a->c.kind == ARENA_TINY ? a->c.type : o->type;
+}
 
-	int numunits = (objsize + ALLOC_UNIT - 1) >> 4;
+static inline int is_gray(struct arena * a, struct obj * o) {
+	if (a->c.kind != ARENA_TINY)
+		return o->gray;
+	size_t c = CELL_OF(a, o);
+	return !!(grays_of(a)[c / WORD_BITS] & BIT(c));
+}
 
-	/* TODO: add first-fit or best-fit strategies when
-	 * there is significant fragmentation pressure */
-	if (a->a.nextcell + numunits > (ARENA_SIZE >> 4))
-		return 0;	/* no room */
+static inline void set_gray(struct arena * a, struct obj * o, int gray) {
+	if (a->c.kind != ARENA_TINY) {
+		o->gray = gray;
+		return;
+	}
+	size_t c = CELL_OF(a, o);
+	if (gray)
+		grays_of(a)[c / WORD_BITS] |= BIT(c);
+	else
+		grays_of(a)[c / WORD_BITS] &= ~BIT(c);
+}
 
-	struct obj * o = (struct obj *)((size_t)a + (a->a.nextcell << 4));
-	o->gray = 0;	/* new objects white? */
-	a->a.nextcell += numunits;
+/* set n consecutive bits in a used/mark array, starting at cell c */
+static inline void set_cells(word_t * map, size_t c, int n) {
+	while (n > 0) {
+		int bit = c % WORD_BITS;
+		int run = n < (int)WORD_BITS - bit ? n : (int)WORD_BITS - bit;
+		word_t m = (run == WORD_BITS) ? ~(word_t)0 : (BIT(run) - 1) << bit;
+		map[c / WORD_BITS] |= m;
+		c += run;
+		n -= run;
+	}
+}
 
-	return 0;
+/* the same, for bitmaps other threads are setting bits in too */
+static inline void set_cells_atomic(word_t * map, size_t c, int n) {
+	while (n > 0) {
+		int bit = c % WORD_BITS;
+		int run = n < (int)WORD_BITS - bit ? n : (int)WORD_BITS - bit;
+		word_t m = (run == WORD_BITS) ? ~(word_t)0 : (BIT(run) - 1) << bit;
+		__atomic_fetch_or( &map[c / WORD_BITS], m, __ATOMIC_RELAXED );
+		c += run;
+		n -= run;
+	}
 }
 
-/* due to arenas being aligned to 64K, we can just mask off
- * these bits */
-static inline struct arena * get_arena(struct obj * o) {
-	size_t s = (size_t) o;
-	return (struct arena *)( s & ~((size_t)0x0ffff) );
+/* and clear them */
+static inline void clear_cells(word_t * map, size_t c, int n) {
+	while (n > 0) {
+		int bit = c % WORD_BITS;
+		int run = n < (int)WORD_BITS - bit ? n : (int)WORD_BITS - bit;
+		word_t m = (run == WORD_BITS) ? ~(word_t)0 : (BIT(run) - 1) << bit;
+		map[c / WORD_BITS] &= ~m;
+		c += run;
+		n -= run;
+	}
 }
 
-/* gray stacks ----------------------------------------------------------- */
+static inline void clear_cells_atomic(word_t * map, size_t c, int n) {
+	while (n > 0) {
+		int bit = c % WORD_BITS;
+		int run = n < (int)WORD_BITS - bit ? n : (int)WORD_BITS - bit;
+		word_t m = (run == WORD_BITS) ? ~(word_t)0 : (BIT(run) - 1) << bit;
+		__atomic_fetch_and( &map[c / WORD_BITS], ~m, __ATOMIC_RELAXED );
+		c += run;
+		n -= run;
+	}
+}
 
-struct gs {
-	int n;
-	struct gs * prev;
-	struct obj * data[GS_SIZE];
+/* collector state ------------------------------------------------------- */
+
+enum gc_phase {
+	GC_IDLE,	/* no cycle in progress */
+	GC_ROOTS,	/* shading roots */
+	GC_MARK,	/* draining gray stacks */
+	GC_WEAK,	/* clearing weak slots, finding finalizers due */
+	GC_SWEEP,	/* marking done; arenas not swept yet */
 };
 
-/* stash of a few gs chunks, to avoid churning the system
- * allocator during marking */
-static struct gs * spare_gs = 0;
+static struct {
+	enum gc_phase phase;
+	unsigned epoch;		/* bumped each time marking finishes */
+	struct arena * gray;	/* arenas which (may) have a nonempty gs */
+	struct arena * drain;	/* the one marking is taking grays from */
+	size_t root_cursor;
+	size_t weak_cursor;
+	struct arena * sweep_cursor;
+	struct arena ** sweep_large;	/* link to the next large object */
+	int lazy;		/* this cycle's arenas are swept by allocation */
+	int sticky;		/* mark bits were kept by a generational sweep */
+	int side;		/* mark bits are in the side table */
+	word_t sense;		/* bits equal to this are unmarked */
+	unsigned minors;	/* minor collections done */
+	int evac;		/* this cycle copies objects out of sparse arenas */
+	int stepping;		/* in collect_step, whose own allocation (the
+				 * copies evacuation makes) mustn't assist */
 
-/* get a gs chunk from the stash, or alloc a new one. */
-static inline struct gs * gs_get(void) {
-	if (!spare_gs)
-		return malloc(sizeof(struct gs));
+	/* pacing, for heap.gc_percent. all in bytes allocated, ever. */
+	size_t allocated;
+	size_t marked_bytes;	/* by this cycle so far */
+	size_t trigger;		/* when the next cycle should start */
+	size_t goal;		/* when it should be done marking by */
+	size_t work, last_work;	/* done in gc_step by this cycle, and the last */
+	double ratio;		/* how far from the last cycle to the goal the
+				 * trigger is */
+} gc;
 
-	struct gs * gs = spare_gs;
-	spare_gs = gs->prev;
-	return gs;
+/* new objects are black while marking, so they survive the cycle that
+ * was running when they were allocated */
+static inline int gc_marking(void) {
+	return gc.phase == GC_ROOTS || gc.phase == GC_MARK;
 }
 
-/* put a gs chunk back into the stash */
-static inline void gs_put(struct gs * gs) {
-	gs->prev = spare_gs;
-	spare_gs = gs;
+/* stats -----------------------------------------------------------------
+ *
+ * built with GC_STATS nonzero, the collector counts what it does a cycle
+ * at a time, and times its work by kind of span. those spans can also be
+ * logged, and written out in chrome's trace event format for
+ * chrome://tracing or perfetto. built without, none of it is compiled in
+ * and the stats are all zero. a cycle's stats run from the start of its
+ * marking to the start of the next cycle's, so they include whatever
+ * sweeping it left, lazy or not, and any minors in between.
+ */
+
+#ifndef GC_STATS
+#define GC_STATS 0
+#endif
+
+enum gc_span {
+	SPAN_ROOTS,		/* gc_step, by phase */
+	SPAN_MARK,
+	SPAN_WEAK,
+	SPAN_SWEEP,
+	SPAN_MINOR,
+	SPAN_STOPPED,		/* concurrent mode, with the mutators stopped */
+	SPAN_CONC_MARK,		/* concurrent mode, alongside the mutators */
+	SPAN_CONC_SWEEP,
+	SPAN_SCAVENGE,		/* giving memory back */
+	NUM_SPANS,
+};
+
+struct gc_stats {
+	unsigned cycles;
+	unsigned minors;
+	size_t marked, marked_bytes;
+	size_t swept;		/* small arenas */
+	size_t freed_bytes;	/* large objects too */
+	size_t gs_malloc, gs_reused;	/* gs chunks got */
+	size_t barrier_calls;	/* write_barrier with marking on */
+	size_t barrier_pushes;	/* objects it made gray again */
+	size_t scavenged_bytes;	/* arenas and gs chunks given back */
+	size_t rss_before, rss_after;	/* around the latest scavenge */
+	unsigned long long span_ns[NUM_SPANS];
+	unsigned long long max_pause_ns;	/* longest the mutator waited */
+};
+
+#if GC_STATS
+
+static char const * const span_names[NUM_SPANS] = {
+	"roots", "mark", "weak", "sweep", "minor", "stopped", "conc mark", "conc sweep",
+	"scavenge",
+};
+
+struct trace_ev {
+	enum gc_span kind;
+	int tid;
+	unsigned long long ts, dur;
+};
+
+static struct {
+	struct gc_stats cur, last, total;
+	pthread_mutex_t lock;	/* for the trace */
+	int tracing;
+	struct trace_ev * ev;
+	size_t nev, cap;
+	int tids;
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* the barrier is too hot for shared counters, so each thread counts its
+ * own, and adds them in now and then */
+static __thread struct { size_t calls, pushes; } barrier_stats;
+static __thread int trace_tid;
+
+#define STAT(x) do { x; } while(0)
+#define STAT_ADD(f, n) __atomic_fetch_add( &stats.cur.f, (n), __ATOMIC_RELAXED )
+
+static inline unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-/* push an object onto its arena's gs */
-static inline void gs_push(struct arena * a, struct obj * o) {
-	if (!a->a.gs || a->a.gs->n == GS_SIZE) {
-		struct gs * prev = a->a.gs;
-		a->a.gs = gs_get();
-		a->a.gs->n = 0;
-		a->a.gs->prev = prev;
+static void barrier_stats_flush(void) {
+	STAT_ADD(barrier_calls, barrier_stats.calls);
+	STAT_ADD(barrier_pushes, barrier_stats.pushes);
+	barrier_stats.calls = barrier_stats.pushes = 0;
+}
+
+static void trace_add(enum gc_span kind, unsigned long long t0, unsigned long long t) {
+	pthread_mutex_lock( &stats.lock );
+	if (!trace_tid)
+		trace_tid = ++stats.tids;
+	if (stats.nev == stats.cap) {
+		stats.cap = stats.cap ? 2 * stats.cap : 1024;
+		stats.ev = realloc( stats.ev, stats.cap * sizeof(*stats.ev) );
+		if (!stats.ev)
+			die( 1, "trace allocation failed" );
 	}
+	stats.ev[stats.nev++] = (struct trace_ev){ kind, trace_tid, t0, t - t0 };
+	pthread_mutex_unlock( &stats.lock );
+}
 
-	struct gs * gs = a->a.gs;
-	gs->data[ GS_SIZE - ++gs->n ] = o;
+static void span_end(enum gc_span kind, unsigned long long t0) {
+	unsigned long long t = now_ns();
+	__atomic_fetch_add( &stats.cur.span_ns[kind], t - t0, __ATOMIC_RELAXED );
+	if (__atomic_load_n( &stats.tracing, __ATOMIC_RELAXED ))
+		trace_add(kind, t0, t);
 }
 
-/* pop the first object off an arena's gs */
-static inline struct obj * gs_pop(struct arena * a) {
-	struct gs * gs = a->a.gs;
-	if (!gs) return 0;
-	struct obj * o = gs->data[ GS_SIZE - gs->n-- ];
-	if (!gs->n) {
-		a->a.gs = gs->prev;
-		gs_put(gs);
+/* only ever one pause at a time */
+static void pause_end(unsigned long long t0) {
+	unsigned long long d = now_ns() - t0;
+	if (d > stats.cur.max_pause_ns)
+		stats.cur.max_pause_ns = d;
+}
+
+static void stats_sum(struct gc_stats * to, struct gc_stats const * s) {
+	int i;
+	to->cycles += s->cycles;
+	to->minors += s->minors;
+	to->marked += s->marked;
+	to->marked_bytes += s->marked_bytes;
+	to->swept += s->swept;
+	to->freed_bytes += s->freed_bytes;
+	to->gs_malloc += s->gs_malloc;
+	to->gs_reused += s->gs_reused;
+	to->barrier_calls += s->barrier_calls;
+	to->barrier_pushes += s->barrier_pushes;
+	to->scavenged_bytes += s->scavenged_bytes;
+	if (s->rss_after) {
+		to->rss_before = s->rss_before;
+		to->rss_after = s->rss_after;
 	}
-	return o;
+	for( i = 0; i < NUM_SPANS; i++ )
+		to->span_ns[i] += s->span_ns[i];
+	if (s->max_pause_ns > to->max_pause_ns)
+		to->max_pause_ns = s->max_pause_ns;
 }
 
-/* real meat ------------------------------------------------------------- */
+/* a cycle is starting, with the world stopped */
+static void stats_roll(void) {
+	barrier_stats_flush();
+	stats_sum(&stats.total, &stats.cur);
+	stats.last = stats.cur;
+	memset( &stats.cur, 0, sizeof(stats.cur) );
+	stats.cur.cycles = 1;
+}
 
-#define IS_MARKED(a,c)\
-	((a)->mark[(c) >> 5] & ((c) & 0x1f))
-#define MARK(a,c)\
-	do { (a)->mark[(c) >> 5] |= ((c) & 0x1f); } while(0)
+/* the last whole cycle's stats, and everything's so far */
+void gc_get_stats(struct gc_stats * last, struct gc_stats * total) {
+	barrier_stats_flush();
+	if (last)
+		*last = stats.last;
+	if (total) {
+		*total = stats.total;
+		stats_sum(total, &stats.cur);
+	}
+}
 
-/* after writing a ptr field in an object, reachability can change, so make
- * the object gray. if it is now dark-gray, push it back onto the gs for its
- * arena. */
-void write_barrier(struct obj * o) {
-	if (o->gray) return;
-	o->gray = 1;
-	struct arena * a = get_arena(o);
-	size_t cell = (size_t)o - (size_t)a;
-	if (IS_MARKED(a, cell))
-		gs_push(a, o);
+/* forget everything counted so far */
+void gc_reset_stats(void) {
+	barrier_stats_flush();
+	memset( &stats.cur, 0, sizeof(stats.cur) );
+	memset( &stats.last, 0, sizeof(stats.last) );
+	memset( &stats.total, 0, sizeof(stats.total) );
 }
 
-/* pop the first object off an arena's gs, and mark it. */
-int mark(struct arena * a) {
-	struct obj * o = gs_pop(a);
-	if (!o) return 0;
+/* start logging spans, dropping any logged before */
+void gc_trace_start(void) {
+	pthread_mutex_lock( &stats.lock );
+	stats.nev = 0;
+	__atomic_store_n( &stats.tracing, 1, __ATOMIC_RELAXED );
+	pthread_mutex_unlock( &stats.lock );
+}
 
-	/* make it black */
-	size_t cell = (size_t)o - (size_t)a;
-	MARK(a, cell);
-	o->gray = 0;
+/* stop logging, and write out what was, as complete events with
+ * microsecond times. returns 0, or -1 if writing failed */
+int gc_trace_write(FILE * f) {
+	pthread_mutex_lock( &stats.lock );
+	__atomic_store_n( &stats.tracing, 0, __ATOMIC_RELAXED );
+
+	size_t i;
+	fprintf( f, "{\"traceEvents\":[\n" );
+	for( i = 0; i < stats.nev; i++ ) {
+		struct trace_ev * e = &stats.ev[i];
+		fprintf( f, "{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"X\",\"pid\":%d,"
+			"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			span_names[e->kind], (int) getpid(), e->tid,
+			e->ts / 1e3, e->dur / 1e3, i + 1 < stats.nev ? "," : "" );
+	}
+	fprintf( f, "]}\n" );
+	pthread_mutex_unlock( &stats.lock );
+	return fflush( f ) ? -1 : 0;
+}
+
+#define SPAN_START(t) unsigned long long t = now_ns()
+#define SPAN_END(t, kind) span_end((kind), (t))
+#define PAUSE_END(t) pause_end(t)
+
+#else
+
+#define STAT(x) do {} while(0)
+#define STAT_ADD(f, n) do {} while(0)
+#define SPAN_START(t) do {} while(0)
+#define SPAN_END(t, kind) do {} while(0)
+#define PAUSE_END(t) do {} while(0)
+
+static inline void stats_roll(void) {}
+
+void gc_get_stats(struct gc_stats * last, struct gc_stats * total) {
+	if (last)
+		memset( last, 0, sizeof(*last) );
+	if (total)
+		memset( total, 0, sizeof(*total) );
+}
+
+void gc_reset_stats(void) {}
+
+void gc_trace_start(void) {}
+
+int gc_trace_write(FILE * f) {
+	(void) f;
+	return -1;
+}
+
+#endif
+
+/* do x, as a span of the given kind */
+#define TIMED(kind, x) do { SPAN_START(_t); x; SPAN_END(_t, kind); } while(0)
+
+/* where allocation looks for room in an arena */
+enum fit {
+	FIT_NEXT,	/* first free run from where the last one was found */
+	FIT_FIRST,	/* first free run in the arena */
+	FIT_BUMP,	/* just bump nextcell; freed cells are only reused
+			 * once the whole arena is empty */
+};
+
+/* the heap owns every arena. allocation happens in the current arena
+ * until it fills, then moves on to one that sweeping has found room in,
+ * and only makes a new arena when there are none of those. */
+static struct heap {
+	struct arena * arenas;	/* all of them */
+	struct arena * large;	/* large objects */
+	size_t nlarge;
+	size_t large_bytes;
+	struct arena * current;	/* where allocation is happening */
+	struct arena * free;	/* arenas with room, not including current */
+	size_t narenas;
+	enum fit fit;
+	int size_classes;	/* use the small object free lists */
+	int lazy_sweep;		/* leave arenas for allocation to sweep */
+	int mark_threads;	/* mark in parallel when collecting */
+	int prefetch;		/* shade what marking finds through a ring of
+				 * prefetched ptrs; pays off on scattered heaps */
+	int concurrent;		/* a collector thread is running cycles */
+	int generational;	/* collect the nursery on its own */
+	int nursery_arenas;	/* how big it gets first; < 2 for the default */
+	struct arena * nursery;	/* arenas allocated from since the last minor */
+	size_t nyoung;
+	struct arena * dirty;	/* arenas with dirty cards */
+	int evacuate;		/* gc_collect empties arenas less than this
+				 * percent full; 0 to never move anything */
+	int conservative;	/* also take anything on the stack that looks
+				 * like a ptr to an object as a root */
+	size_t reserve;		/* bytes of address space to take arenas from;
+				 * 0 to get each one from the allocator */
+	int side_marks;		/* keep the region's mark bits in a side table */
+	int huge_pages;		/* back the region with 2MB pages if we can */
+	size_t nhuge_advised;	/* arenas in use in huge page groups, which
+				 * the kernel may or may not have backed with
+				 * them; see region_huge_bytes */
+	int gc_percent;		/* let the heap grow by this percent of what
+				 * the last cycle found live before starting
+				 * another; 0 to start one whenever gc_step is
+				 * called */
+	int scavenge_ms;	/* give empty arenas back every this many ms,
+				 * from gc_step or the collector thread; 0 to
+				 * only do it when asked */
+	int scavenge_keep;	/* empty arenas to hold on to when doing so */
+	struct {
+		struct arena * current;
+		struct arena * free;
+	} tiny[NUM_TYPES];	/* the same again for each tiny type */
+} heap;
+
+/* with the generational collector, objects are young until they survive
+ * a collection, and old after. old objects have their first cell set in
+ * the old bitmap, and their mark bits kept set between cycles (sweeping
+ * leaves them alone), so a minor collection can treat them as black and
+ * only has to mark and sweep the young ones. all young objects are in
+ * nursery arenas, and every survivor of a minor collection is promoted,
+ * so a minor only costs as much as the live young objects, the dirty
+ * cards and the nursery's size. a major collection is the usual cycle,
+ * first clearing the marks the old objects kept.
+ *
+ * not done in concurrent mode, since it needs the world stopped, nor
+ * with side table marks, which can't be kept from one cycle to the next
+ * for only some objects. */
+static inline int generational(void) {
+	return heap.generational && !heap.concurrent && !gc.side;
+}
+
+/* held across heap_alloc, and by the collector thread while it sweeps,
+ * but only in concurrent mode */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* arena index -----------------------------------------------------------
+ *
+ * which 64K blocks of the address space belong to the heap, so that an
+ * arbitrary word can be checked for pointing into it. a two level radix
+ * table over addr >> 16, covering 48 bits of address: the top 16 pick a
+ * leaf, and the leaf has the arena for each block it covers. a large
+ * object's mapping is longer than 64K, so every block of it is entered,
+ * all with the arena at its start, and masking isn't needed at all. its
+ * last block is usually only partly mapped, so that entry has its low bit
+ * set to say the address needs checking against the end of the mapping.
+ * leaves are only made for parts of the address space the heap is in,
+ * and never freed.
+ */
+
+#define ARENA_SHIFT (ARENA_LOG2)
+#define INDEX_TOTAL (48 - ARENA_LOG2)
+#define INDEX_BITS ((INDEX_TOTAL + 1) / 2)
+#define INDEX_LEAF (1ul << INDEX_BITS)
+
+static struct arena ** arena_index[1ul << (INDEX_TOTAL - INDEX_BITS)];
+
+static inline size_t arena_span(struct arena * a) {
+	return a->c.kind == ARENA_LARGE ? a->c.mapsize : ARENA_SIZE;
+}
+
+static void index_set(struct arena * a, struct arena * to) {
+	size_t b = (size_t) a >> ARENA_SHIFT;
+	size_t end = ((size_t) a + arena_span(a) + ARENA_SIZE - 1) >> ARENA_SHIFT;
+	int partial = arena_span(a) % ARENA_SIZE != 0;
+	if ((unsigned long long) end >> INDEX_TOTAL)
+		die( 1, "arena %p is out of the index's range", (void *) a );
+
+	for( ; b < end; b++ ) {
+		struct arena ** leaf = arena_index[b >> INDEX_BITS];
+		if (!leaf) {
+			leaf = calloc( INDEX_LEAF, sizeof(*leaf) );
+			if (!leaf)
+				die( 1, "arena index allocation failed" );
+			__atomic_store_n( &arena_index[b >> INDEX_BITS], leaf, __ATOMIC_RELEASE );
+		}
+		struct arena * e = to && partial && b == end - 1
+			? (struct arena *)((size_t) to | 1) : to;
+		__atomic_store_n( &leaf[b & (INDEX_LEAF - 1)], e, __ATOMIC_RELEASE );
+	}
+}
+
+static void index_add(struct arena * a) {
+	index_set(a, a);
+}
+
+static void index_remove(struct arena * a) {
+	index_set(a, 0);
+}
+
+/* the arena p points into, or null */
+static inline struct arena * index_find(void const * p) {
+	size_t b = (size_t) p >> ARENA_SHIFT;
+	if ((unsigned long long) b >> INDEX_TOTAL)
+		return 0;
+	struct arena ** leaf = __atomic_load_n( &arena_index[b >> INDEX_BITS], __ATOMIC_ACQUIRE );
+	if (!leaf)
+		return 0;
+
+	struct arena * a = __atomic_load_n( &leaf[b & (INDEX_LEAF - 1)], __ATOMIC_ACQUIRE );
+	if (__builtin_expect((size_t) a & 1, 0)) {
+		a = (struct arena *)((size_t) a & ~(size_t) 1);
+		if ((char const *) p >= (char const *) a + a->c.mapsize)
+			return 0;
+	}
+	return a;
+}
+
+/* is p anywhere in an arena of this heap? */
+int is_heap_ptr(void const * p) {
+	return index_find(p) != 0;
+}
+
+/* the region ------------------------------------------------------------
+ *
+ * with heap.reserve set, arenas come out of one range of address space,
+ * reserved PROT_NONE the first time an arena is wanted, and made
+ * read/write REGION_BATCH arenas at a time as the heap grows into it.
+ * this keeps the heap together, and costs no alignment padding or
+ * allocator call per arena. an arena given back has its pages dropped
+ * with madvise, and waits on the spare list to be handed out again.
+ * once the region is full, arenas come from the allocator as usual.
+ *
+ * with heap.huge_pages also set when the region is made, it is aligned to
+ * HUGE_SIZE and committed a huge page at a time, each one advised as a
+ * transparent huge page: 32 arenas to a tlb entry instead of 512. if the
+ * kernel won't have it, the group is left on small pages. the advice is
+ * only a hint, taken even with THP off, so whether the pages really are
+ * huge is only known from smaps. arenas in a huge group keep their pages
+ * when given back, since dropping 64K of a huge page would only split it.
+ */
+
+#define REGION_BATCH (16)
+#define HUGE_SIZE (2ul << 20)
+
+/* a huge page's worth of arenas, or one arena if they are bigger */
+#define HUGE_GROUP (HUGE_SIZE > ARENA_SIZE ? HUGE_SIZE : (size_t) ARENA_SIZE)
+
+static struct {
+	int tried;
+	int huge;		/* committed in huge page groups */
+	char * base, * end;
+	char * next;		/* first block never handed out */
+	char * committed;	/* [base, committed) is read/write */
+	struct arena ** spare;	/* given back, pages dropped */
+	size_t nspare, spare_cap;
+	unsigned char * hugegroup;	/* per group: MADV_HUGEPAGE was taken */
+	word_t * marks;		/* the side table, ARENA_WORDS to an arena */
+} region;
+
+#ifdef MADV_FREE
+#define REGION_DROP MADV_FREE
+#else
+#define REGION_DROP MADV_DONTNEED
+#endif
 
-	/* TODO: walk pointers from this object, and
-	 * push them onto their arena's gs.
-	 *
-	 * This is heavily dependent on the structure of the actual
-	 * objects!
-	 * */
+static inline int in_region(void const * p) {
+	return (char const *) p >= region.base && (char const *) p < region.end;
+}
+
+static inline int in_huge_group(void const * p) {
+	return region.huge && region.hugegroup[((char const *) p - region.base) / HUGE_GROUP];
+}
+
+static void region_init(void) {
+	region.tried = 1;
+	size_t align = heap.huge_pages ? HUGE_GROUP : (size_t) ARENA_SIZE;
+	size_t size = (heap.reserve + align - 1) & ~(align - 1);
+	char * p = mmap( 0, size + align, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if (p == MAP_FAILED)
+		return;		/* the allocator it is, then */
+
+	char * base = (char *)(((size_t)p + align - 1) & ~(align - 1));
+	if (base > p)
+		munmap( p, base - p );
+	if (base + size < p + size + align)
+		munmap( base + size, p + size + align - (base + size) );
+
+	region.base = region.next = region.committed = base;
+	region.end = base + size;
+
+	if (heap.huge_pages) {
+		region.hugegroup = calloc( size / HUGE_GROUP, 1 );
+		region.huge = region.hugegroup != 0;
+	}
+}
+
+/* make the next batch of the region read/write */
+static int region_commit(void) {
+	size_t n = (size_t)(region.end - region.committed);
+	size_t batch = region.huge ? HUGE_GROUP : (size_t) REGION_BATCH * ARENA_SIZE;
+	if (n > batch)
+		n = batch;
+	if (mprotect( region.committed, n, PROT_READ | PROT_WRITE ))
+		return 0;
 
+#ifdef MADV_HUGEPAGE
+	if (region.huge && !madvise( region.committed, n, MADV_HUGEPAGE ))
+		region.hugegroup[(region.committed - region.base) / HUGE_GROUP] = 1;
+#endif
+	region.committed += n;
 	return 1;
 }
 
-/* sweep away all unmarked objects remaining in an arena */
-void sweep(struct arena * a) {
-	if (a->a.gs && a->a.gs->n)
-		die( 1, "broken GC: arena %p had things remaining to mark", a);
+/* a block for an arena, or null if the region is used up */
+static struct arena * region_take(void) {
+	struct arena * a;
+	if (!region.tried)
+		region_init();
 
-	size_t i;
-	for( i = sizeof(*a) >> 9; i < sizeof(a->used) / sizeof(*a->used); i++ ) {
-		int mark = a->mark[i];
-		int used = a->used[i];
+	if (region.nspare)
+		a = region.spare[--region.nspare];
+	else if (region.next == region.end)
+		return 0;
+	else if (region.next == region.committed && !region_commit())
+		return 0;
+	else {
+		a = (struct arena *) region.next;
+		region.next += ARENA_SIZE;
+	}
+
+	heap.nhuge_advised += in_huge_group(a);
+	return a;
+}
 
-		a->mark[i] = used & mark;
-		a->used[i] = used ^ mark;
+static void region_give(struct arena * a) {
+	if (region.nspare == region.spare_cap) {
+		region.spare_cap = region.spare_cap ? 2 * region.spare_cap : 64;
+		region.spare = realloc( region.spare, region.spare_cap * sizeof(*region.spare) );
+		if (!region.spare)
+			die( 1, "region spare list allocation failed" );
 	}
+	if (in_huge_group(a))
+		heap.nhuge_advised--;
+	else
+		madvise( a, ARENA_SIZE, REGION_DROP );
+	region.spare[region.nspare++] = a;
 }
 
-/* test driver code ------------------------------------------------------ */
+/* bytes of the region actually on huge pages, by the kernel's count in
+ * /proc/self/smaps. MADV_HUGEPAGE succeeds even with THP off, so this
+ * is the only way to know. 0 if it can't be read. */
+static size_t region_huge_bytes(void) {
+	FILE * f = fopen( "/proc/self/smaps", "r" );
+	if (!f || !region.base) {
+		if (f)
+			fclose( f );
+		return 0;
+	}
 
-int main(void) {
-	printf( "sizes: arena meta: %zd a: %zd b: %zd: gs: %zd\n",
-			sizeof(struct arena),
-			sizeof(struct arena_meta_a),
-			sizeof(struct arena_meta_b),
-			sizeof(struct gs));
+	char line[256];
+	size_t kb = 0, n;
+	int in = 0;
+	unsigned long lo, hi;
+	while (fgets( line, sizeof(line), f )) {
+		if (sscanf( line, "%lx-%lx ", &lo, &hi ) == 2)
+			in = (char *) lo < region.end && (char *) hi > region.base;
+		else if (in && sscanf( line, "AnonHugePages: %zu kB", &n ) == 1)
+			kb += n;
+	}
+	fclose( f );
+	return kb << 10;
+}
 
-	struct arena * a = arena_new();
-	struct obj * o = arena_alloc(a, 32);
+/* mark bits -------------------------------------------------------------
+ *
+ * normally in the arena header, next to the used bits, and cleared by
+ * sweeping. once heap.side_marks is set (and a region made), the next
+ * cycle moves the region's arenas' bits to a side table, so marking doesn't
+ * write to the cache lines the allocator is using, and nothing clears
+ * them: a bit means marked when it differs from gc.sense, which flips as
+ * each cycle starts. everything a cycle leaves alive is marked until
+ * then, and so is everything allocated in between, so the flip whitens
+ * the lot at once. arenas outside the region (large objects, and any
+ * made once it is full) go by gc.sense too; only their bits are in the
+ * header.
+ */
 
-	if (!o)
-		die( 1, "failed: alloc object from %p", a );
+static inline word_t * marks_of(struct arena * a) {
+	if (gc.side && in_region(a))
+		return region.marks + (((char *) a - region.base) >> ARENA_LOG2) * ARENA_WORDS;
+	return a->mark;
+}
+
+static inline void mark_cells(struct arena * a, size_t c, int n) {
+	if (gc.sense)
+		clear_cells(marks_of(a), c, n);
+	else
+		set_cells(marks_of(a), c, n);
+}
+
+/* for mark bits other threads are setting too */
+static inline void mark_cells_atomic(struct arena * a, size_t c, int n) {
+	if (gc.sense)
+		clear_cells_atomic(marks_of(a), c, n);
+	else
+		set_cells_atomic(marks_of(a), c, n);
+}
+
+static inline int is_marked_atomic(struct arena * a, size_t c) {
+	word_t w = __atomic_load_n( &marks_of(a)[c / WORD_BITS], __ATOMIC_RELAXED );
+	return !!((w ^ gc.sense) & BIT(c));
+}
+
+/* new objects get marked outside a cycle too, when the flip is what
+ * turns them white, and until sweeping starts, so that weak slots don't
+ * lose them */
+static inline int alloc_marked(void) {
+	return gc.side || gc_marking() || gc.phase == GC_WEAK;
+}
+
+/* arenas ---------------------------------------------------------------- */
+
+int sweep(struct arena * a);
+
+struct arena * arena_new(void) {
+	struct arena * a = heap.reserve ? region_take() : 0;
+	if (!a && posix_memalign( (void **) &a, ARENA_SIZE, ARENA_SIZE ))
+		die( 1, "arena allocation failed" );
+
+	memset( a, 0, sizeof(*a) );
+	a->a.nextcell = ARENA_HDR_UNITS;
+	a->c.swept = gc.epoch;
+	a->c.next = heap.arenas;
+	heap.arenas = a;
+	heap.narenas++;
+	index_add(a);
+
+	return a;
+}
+
+/* an arena the heap has stopped using, and which no list has any more */
+static void arena_free(struct arena * a) {
+	heap.narenas--;
+	index_remove(a);
+	if (in_region(a))
+		region_give(a);
+	else if (a->c.mapped)
+		munmap( a, ARENA_SIZE );
+	else
+		free( a );
+}
+
+/* first used cell in [c, end), or end if there isn't one */
+static inline int next_used(struct arena * a, int c, int end) {
+	if (c >= end)
+		return end;
+	size_t w = c / WORD_BITS;
+	word_t bits = a->used[w] & (~(word_t)0 << (c % WORD_BITS));
+	while (!bits) {
+		if (++w * WORD_BITS >= (size_t)end)
+			return end;
+		bits = a->used[w];
+	}
+	c = w * WORD_BITS + __builtin_ctzl(bits);
+	return c < end ? c : end;
+}
+
+/* first free cell in [c, end), or end if there isn't one */
+static inline int next_free(struct arena * a, int c, int end) {
+	if (c >= end)
+		return end;
+	size_t w = c / WORD_BITS;
+	word_t bits = ~a->used[w] & (~(word_t)0 << (c % WORD_BITS));
+	while (!bits) {
+		if (++w * WORD_BITS >= (size_t)end)
+			return end;
+		bits = ~a->used[w];
+	}
+	c = w * WORD_BITS + __builtin_ctzl(bits);
+	return c < end ? c : end;
+}
+
+/* start of the first run of n free cells in [c, end), or -1 */
+static inline int find_free(struct arena * a, int c, int end, int n) {
+	while (c + n <= end) {
+		c = next_free(a, c, end);
+		if (c + n > end)
+			break;
+		int e = next_used(a, c, c + n);
+		if (e == c + n)
+			return c;
+		c = e;
+	}
+	return -1;
+}
+
+/* size-class free lists --------------------------------------------------
+ *
+ * sweep() puts every free run of up to SIZE_CLASSES cells on the list for
+ * its length, threaded through the first word of each run. the used bitmap
+ * is still the truth about which cells are free; the lists just save
+ * looking for small runs. since every small run is on a list, the bitmap
+ * scan only looks for runs longer than SIZE_CLASSES, and anything shorter
+ * it leaves behind goes straight onto a list.
+ */
+
+static inline unsigned * fl_link(struct arena * a, int c) {
+	return (unsigned *)((size_t)a + (c << UNIT_LOG2));
+}
+
+static inline void fl_push(struct arena * a, int c, int n) {
+	*fl_link(a, c) = a->c.fl[n - 1];
+	a->c.fl[n - 1] = c;
+	a->c.flmask |= 1u << (n - 1);
+}
+
+static inline int fl_pop(struct arena * a, int n) {
+	int c = a->c.fl[n - 1];
+	if (c && !(a->c.fl[n - 1] = *fl_link(a, c)))
+		a->c.flmask &= ~(1u << (n - 1));
+	return c;
+}
+
+/* take n cells from the smallest longer run on the lists, returning the
+ * rest to the list for its length */
+static inline int fl_split(struct arena * a, int n) {
+	unsigned m = a->c.flmask & (~0u << n);
+	if (!m)
+		return 0;
+
+	int i = __builtin_ctz(m) + 1;
+	int c = fl_pop(a, i);
+	fl_push(a, c + n, i - n);
+	return c;
+}
+
+/* a run scan allocation has left [c, ...) free; if that is a small run,
+ * it belongs on a list */
+static inline void fl_tail(struct arena * a, int c) {
+	int end = c + SIZE_CLASSES + 1;
+	int e = next_used(a, c, end < ARENA_CELLS ? end : ARENA_CELLS);
+	if (e > c && e - c <= SIZE_CLASSES)
+		fl_push(a, c, e - c);
+}
+
+/* rebuild the lists of a freshly swept arena, in address order */
+static void fl_rebuild(struct arena * a) {
+	unsigned * tail[SIZE_CLASSES];
+	int i;
+	for( i = 0; i < SIZE_CLASSES; i++ )
+		tail[i] = &a->c.fl[i];
+
+	a->c.nobig = 1;
+	int c = ARENA_HDR_UNITS;
+	while ((c = next_free(a, c, ARENA_CELLS)) < ARENA_CELLS) {
+		int e = next_used(a, c, ARENA_CELLS);
+		if (e - c <= SIZE_CLASSES) {
+			*tail[e - c - 1] = c;
+			tail[e - c - 1] = fl_link(a, c);
+		} else
+			a->c.nobig = 0;
+		c = e;
+	}
+
+	a->c.flmask = 0;
+	for( i = 0; i < SIZE_CLASSES; i++ ) {
+		*tail[i] = 0;
+		if (a->c.fl[i])
+			a->c.flmask |= 1u << i;
+	}
+}
+
+/* find a run of n free cells with the heap's fit strategy, or -1.
+ * a failed scan is the expensive case, so with size classes on, an arena
+ * remembers when it has no runs left that the scan could find. */
+static inline int find_room(struct arena * a, int n) {
+	int c;
+
+	/* nextcell is where the last allocation ended, so for next-fit
+	 * the first run looked at is usually the one wanted */
+	switch (heap.fit) {
+	case FIT_NEXT:
+		c = find_free(a, a->a.nextcell, ARENA_CELLS, n);
+		if (c < 0) {
+			int end = a->a.nextcell + n - 1;
+			c = find_free(a, ARENA_HDR_UNITS,
+					end < ARENA_CELLS ? end : ARENA_CELLS, n);
+		}
+		return c;
+	case FIT_FIRST:
+		return find_free(a, ARENA_HDR_UNITS, ARENA_CELLS, n);
+	default:
+		return a->a.nextcell + n > ARENA_CELLS ? -1 : a->a.nextcell;
+	}
+}
+
+static inline int use_size_classes(void) {
+	return heap.size_classes && heap.fit != FIT_BUMP;
+}
+
+/* allocate the n cells at c. new objects are zeroed, so there are no
+ * stray ptrs to trace. */
+static inline void use_cells(struct arena * a, int c, int n) {
+	memset( (char *) a + (c << UNIT_LOG2), 0, n << UNIT_LOG2 );
+	set_cells(a->used, c, n);
+	a->starts[c / WORD_BITS] |= BIT(c);
+	if (alloc_marked() && heap.concurrent)
+		mark_cells_atomic(a, c, n);
+	else if (alloc_marked()) {
+		mark_cells(a, c, n);
+		if (generational())
+			SET_OLD(a, c);
+	}
+}
+
+struct obj * arena_alloc(struct arena * a, size_t objsize) {
+	if (objsize < sizeof(struct obj))
+		return 0; /* can't allocate less than a gc header */
+
+	/* sweep lazily, if the collector hasn't got to this arena yet */
+	if (a->c.swept != gc.epoch)
+		sweep(a);
+
+	int numunits = (objsize + ALLOC_UNIT - 1) >> UNIT_LOG2;
+	int c;
+
+	if (!use_size_classes())
+		c = find_room(a, numunits);
+	else if (numunits <= SIZE_CLASSES && (c = fl_pop(a, numunits)))
+		;
+	else {
+		c = a->c.nobig ? -1 : find_room(a, numunits > SIZE_CLASSES
+				? numunits : SIZE_CLASSES + 1);
+		if (c >= 0)
+			fl_tail(a, c + numunits);
+		else if (numunits <= SIZE_CLASSES) {
+			a->c.nobig = 1;
+			if (!(c = fl_split(a, numunits)))
+				c = -1;
+		}
+	}
+
+	if (c < 0)
+		return 0;	/* no room */
+
+	struct obj * o = (struct obj *)((size_t)a + (c << UNIT_LOG2));
+	use_cells(a, c, numunits);
+	a->a.nextcell = c + numunits;
+
+	return o;
+}
+
+/* an arena goes back on the heap's free list after sweeping if at least
+ * this many of its cells are free */
+#define ARENA_REUSE_CELLS (ARENA_CELLS / 16)
+
+/* biggest object an arena can hold */
+#define ARENA_MAX_OBJ (ARENA_SIZE - ARENA_HDR_UNITS * ALLOC_UNIT)
+
+/* make an arena with room available for allocation. a tiny arena is
+ * only any use to its own type. */
+static void heap_add_free(struct arena * a) {
+	struct arena ** list = &heap.free, * current = heap.current;
+	if (a->c.kind == ARENA_TINY) {
+		list = &heap.tiny[a->c.type].free;
+		current = heap.tiny[a->c.type].current;
+	}
+	if (a->c.onfree || a->c.owned || a->c.evacuating || a == current)
+		return;
+	a->c.onfree = 1;
+	a->c.freenext = *list;
+	*list = a;
+}
+
+/* large objects ----------------------------------------------------------
+ *
+ * objects too big for an arena get a mapping of their own. it is aligned
+ * like an arena and starts with an arena header, and the object is in the
+ * first cell after that, so get_arena() on the object still finds the
+ * header, and the gs and mark bit are the ones for that cell. nothing
+ * past the first cell's bits is ever used. (an interior ptr more than 64K
+ * into the object does not mask back to the header, but nothing makes
+ * those.)
+ */
+
+static struct obj * large_alloc(size_t objsize) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (ARENA_HDR_UNITS * ALLOC_UNIT + objsize + page - 1) & ~(page - 1);
+
+	/* overmap, then trim to ARENA_SIZE alignment */
+	char * p = mmap( 0, size + ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if (p == MAP_FAILED)
+		return 0;
+
+	char * base = (char *)(((size_t)p + ARENA_SIZE - 1) & ~((size_t)ARENA_SIZE - 1));
+	if (base > p)
+		munmap( p, base - p );
+	if (base + size < p + size + ARENA_SIZE)
+		munmap( base + size, p + size + ARENA_SIZE - (base + size) );
+
+	/* fresh anonymous memory is already zeroed */
+	struct arena * a = (struct arena *) base;
+	a->c.kind = ARENA_LARGE;
+	a->c.mapsize = size;
+	a->c.swept = gc.epoch;
+	a->c.next = heap.large;
+	heap.large = a;
+	heap.nlarge++;
+	heap.large_bytes += size;
+	index_add(a);
+
+	a->used[ARENA_HDR_UNITS / WORD_BITS] |= BIT(ARENA_HDR_UNITS);
+	if (alloc_marked())
+		MARK(a, ARENA_HDR_UNITS);
+
+	return (struct obj *)(base + ARENA_HDR_UNITS * ALLOC_UNIT);
+}
+
+/* sweep a large object; returns 1 if it was freed */
+static int large_sweep(struct arena * a) {
+	if (a->a.gs)
+		die( 1, "broken GC: large object %p had things remaining to mark", a );
+
+	a->c.swept = gc.epoch;
+	if (IS_MARKED(a, ARENA_HDR_UNITS)) {
+		if (!gc.side)
+			a->mark[ARENA_HDR_UNITS / WORD_BITS] &= ~BIT(ARENA_HDR_UNITS);
+		return 0;
+	}
+
+	heap.nlarge--;
+	heap.large_bytes -= a->c.mapsize;
+	STAT_ADD(freed_bytes, a->c.mapsize);
+	index_remove(a);
+	munmap( a, a->c.mapsize );
+	return 1;
+}
+
+/* sweep arenas the collector hasn't got to yet, until one of them turns
+ * out to have room on the given free list. with lazy sweeping, this is
+ * how most arenas get swept. */
+static struct arena * heap_sweep_for_room(struct arena ** list) {
+	while (!*list && gc.sweep_cursor) {
+		struct arena * a = gc.sweep_cursor;
+		gc.sweep_cursor = a->c.next;
+		if (a->c.swept != gc.epoch && !a->c.owned)
+			sweep(a);
+	}
+	return *list;
+}
+
+/* an arena off a free list, sweeping for one if need be, or null */
+static struct arena * heap_take_free(struct arena ** list) {
+	struct arena * a = *list ? *list : heap_sweep_for_room(list);
+	if (a) {
+		*list = a->c.freenext;
+		a->c.onfree = 0;
+	}
+	return a;
+}
+
+/* an arena for allocation to move on to: one that sweeping has found room
+ * in, or failing that a new one */
+static struct arena * heap_take_arena(void) {
+	struct arena * a = heap_take_free(&heap.free);
+	return a ? a : arena_new();
+}
+
+#define NURSERY_ARENAS (16)
+
+static void nursery_add(struct arena * a) {
+	if (a->c.young)
+		return;
+	a->c.young = 1;
+	a->c.nursenext = heap.nursery;
+	heap.nursery = a;
+	heap.nyoung++;
+}
+
+static inline int minor_due(void) {
+	int limit = heap.nursery_arenas > 1 ? heap.nursery_arenas : NURSERY_ARENAS;
+	return generational() && heap.nyoung >= (size_t) limit
+		&& gc.phase == GC_IDLE && heap.current;
+}
+
+void gc_minor(void);
+
+/* allocate an object of the given type from anywhere in the heap, growing
+ * it if need be. returns null only if the system is out of memory for a
+ * large object. */
+static void assist_alloc(size_t objsize);
+static int type_is_tiny(int type);
+static struct obj * tiny_alloc(int type, size_t objsize);
+
+static struct obj * heap_alloc_locked(int type, size_t objsize) {
+	/* paced, the debt is paid before the object exists, so a cycle
+	 * never runs while it is still uninitialised */
+	if (heap.gc_percent && !heap.concurrent)
+		assist_alloc(objsize);
+
+	if (type_is_tiny(type))
+		return tiny_alloc(type, objsize);
+
+	if (objsize > ARENA_MAX_OBJ) {
+		struct obj * o = large_alloc(objsize);
+		if (o) {
+			o->type = type;
+			gc.allocated += objsize;
+		}
+		return o;
+	}
+
+	struct arena * a = heap.current;
+	struct obj * o = a ? arena_alloc(a, objsize) : 0;
+
+	while (!o) {
+		/* a full nursery is collected before it gets any bigger,
+		 * which may well make room in the current arena */
+		if (minor_due()) {
+			gc_minor();
+			o = arena_alloc(heap.current, objsize);
+			continue;
+		}
+
+		/* arenas that can't fit this object drop off the free list
+		 * until sweeping finds them more room */
+		a = heap_take_arena();
+		heap.current = a;
+		if (generational())
+			nursery_add(a);
+		o = arena_alloc(a, objsize);
+	}
+
+	o->type = type;
+	gc.allocated += objsize;
+	return o;
+}
+
+static struct obj * conc_alloc(int type, size_t objsize);
+
+/* allocate an object of the given type. zeroed. */
+struct obj * heap_alloc(int type, size_t objsize) {
+	if (heap.concurrent)
+		return conc_alloc(type, objsize);
+	return heap_alloc_locked(type, objsize);
+}
+
+/* due to arenas being aligned to ARENA_SIZE, we can just mask off
+ * these bits */
+static inline struct arena * get_arena(struct obj * o) {
+	size_t s = (size_t) o;
+	return (struct arena *)( s & ~((size_t)ARENA_SIZE - 1) );
+}
+
+/* gray stacks ----------------------------------------------------------- */
+
+struct gs {
+	int n;
+	struct gs * prev;
+	struct obj * data[GS_SIZE];
+};
+
+/* spare gs chunks, so marking doesn't churn the system allocator. each
+ * thread keeps a few to itself, and overflows into a pool shared by all
+ * of them. */
+#define GS_CACHE_MAX (8)
+
+/* chunks the pool keeps across collections. anything over this is
+ * freed once marking is done. */
+#define GS_POOL_HIGH (64)
+
+struct gs_cache {
+	struct gs * list;
+	int n;
+};
+
+static __thread struct gs_cache gs_cache;
+
+/* the pool is a treiber stack. the head packs a chunk ptr into the low
+ * 48 bits with a tag in the top 16, bumped on every pop, so a pop which
+ * races with a pop and push of the same chunk fails its cas instead of
+ * linking in a stale prev. chunks are only ever freed by the collector
+ * thread with nobody else marking, so reading prev from a chunk that has
+ * just been popped by someone else is safe. */
+#define GS_PTR_BITS (48)
+#define GS_PTR_MASK ((1ull << GS_PTR_BITS) - 1)
+
+typedef char CHECK_GS_PTR_FITS[ sizeof(void *) <= 8 ? 1 : -1 ];
+
+static struct {
+	unsigned long long head;
+	int n;			/* chunks in the pool */
+} gs_pool;
+
+static inline struct gs * gs_head_ptr(unsigned long long h) {
+	return (struct gs *)(size_t)(h & GS_PTR_MASK);
+}
+
+static inline unsigned long long gs_head(struct gs * gs, unsigned long long h) {
+	return ((h >> GS_PTR_BITS) << GS_PTR_BITS) | (size_t) gs;
+}
+
+static void gs_pool_push(struct gs * gs) {
+	unsigned long long h = __atomic_load_n( &gs_pool.head, __ATOMIC_RELAXED );
+	do
+		__atomic_store_n( &gs->prev, gs_head_ptr(h), __ATOMIC_RELAXED );
+	while (!__atomic_compare_exchange_n( &gs_pool.head, &h, gs_head(gs, h),
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED ));
+	__atomic_add_fetch( &gs_pool.n, 1, __ATOMIC_RELAXED );
+}
+
+static struct gs * gs_pool_pop(void) {
+	unsigned long long h = __atomic_load_n( &gs_pool.head, __ATOMIC_ACQUIRE );
+	struct gs * gs;
+	do {
+		if (!(gs = gs_head_ptr(h)))
+			return 0;
+	} while (!__atomic_compare_exchange_n( &gs_pool.head, &h,
+		gs_head(__atomic_load_n( &gs->prev, __ATOMIC_RELAXED ),
+			h + (1ull << GS_PTR_BITS)),
+		1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE ));
+	__atomic_sub_fetch( &gs_pool.n, 1, __ATOMIC_RELAXED );
+	return gs;
+}
+
+/* get a gs chunk from this thread's cache, then the pool, or alloc a
+ * new one. */
+static inline struct gs * gs_get(void) {
+	struct gs * gs = gs_cache.list;
+	if (gs) {
+		gs_cache.list = gs->prev;
+		gs_cache.n--;
+		STAT_ADD(gs_reused, 1);
+		return gs;
+	}
+
+	if ((gs = gs_pool_pop())) {
+		STAT_ADD(gs_reused, 1);
+		return gs;
+	}
+	if (!(gs = malloc(sizeof(struct gs))))
+		die( 1, "gs allocation failed" );
+	STAT_ADD(gs_malloc, 1);
+	return gs;
+}
+
+/* put a gs chunk back, in this thread's cache if there is room */
+static inline void gs_put(struct gs * gs) {
+	if (gs_cache.n < GS_CACHE_MAX) {
+		gs->prev = gs_cache.list;
+		gs_cache.list = gs;
+		gs_cache.n++;
+	} else
+		gs_pool_push(gs);
+}
+
+/* hand this thread's cached chunks to the pool. mark threads do this
+ * before exiting. */
+static void gs_cache_flush(void) {
+	while (gs_cache.list) {
+		struct gs * gs = gs_cache.list;
+		gs_cache.list = gs->prev;
+		gs_pool_push(gs);
+	}
+	gs_cache.n = 0;
+}
+
+/* free whatever the pool holds over keep chunks, and return how many
+ * that was. only safe when no other thread can be in gs_pool_pop. */
+static int gs_trim(int keep) {
+	int n = 0;
+	for( ; __atomic_load_n( &gs_pool.n, __ATOMIC_RELAXED ) > keep; n++ )
+		free( gs_pool_pop() );
+	return n;
+}
+
+/* push an object onto its arena's gs. an arena whose gs goes from empty
+ * to nonempty is put on the gray arena list, unless it is still there. */
+static inline void gs_push(struct arena * a, struct obj * o) {
+	if (!a->a.gs || a->a.gs->n == GS_SIZE) {
+		struct gs * prev = a->a.gs;
+		if (!prev && !a->b.ongray) {
+			a->b.ongray = 1;
+			a->b.graynext = gc.gray;
+			gc.gray = a;
+		}
+		a->a.gs = gs_get();
+		a->a.gs->n = 0;
+		a->a.gs->prev = prev;
+	}
+
+	struct gs * gs = a->a.gs;
+	gs->data[ GS_SIZE - ++gs->n ] = o;
+}
+
+/* pop the first object off an arena's gs */
+static inline struct obj * gs_pop(struct arena * a) {
+	struct gs * gs = a->a.gs;
+	if (!gs) return 0;
+	struct obj * o = gs->data[ GS_SIZE - gs->n-- ];
+	if (!gs->n) {
+		a->a.gs = gs->prev;
+		gs_put(gs);
+	}
+	return o;
+}
+
+/* type descriptors ------------------------------------------------------ */
+
+#define PTRMAP_BITS WORD_BITS
+
+/* called once for each ptr slot in an object. gets the slot rather than
+ * the ptr so that the collector can overwrite it. */
+typedef void (*visit_fn)(struct obj ** slot);
+
+/* custom tracer for objects the ptrmap can't describe. must call visit
+ * on every ptr slot in the object. */
+typedef void (*trace_fn)(struct obj * o, visit_fn visit);
+
+/* size in bytes of a variable-sized object, including its header */
+typedef size_t (*size_fn)(struct obj * o);
+
+struct type {
+	int units;		/* allocation units per object, or 0 if variable */
+	int tiny;		/* headerless, in tiny arenas */
+	size_fn size;		/* only for variable-sized types */
+	trace_fn trace;		/* if set, ptrmap is not used */
+	int nmap;		/* words in ptrmap */
+	unsigned long * ptrmap;	/* bit n set => word n of the object is a ptr */
+};
+
+static struct type types[NUM_TYPES];
+
+static inline int units_for(size_t size) {
+	return (size + ALLOC_UNIT - 1) >> UNIT_LOG2;
+}
+
+static void type_check_free(int type) {
+	if (type < 0 || type >= NUM_TYPES)
+		die( 1, "type %d out of range", type );
+	if (types[type].units || types[type].size)
+		die( 1, "type %d registered twice", type );
+}
+
+/* fold ptr field offsets into a word bitmap, so that marking never looks
+ * at them again. none can be below first, which is where the header
+ * ends. */
+static void type_map(int type, size_t size, size_t first, size_t const * offsets, int n) {
+	struct type * t = &types[type];
+	size_t words = (size + sizeof(struct obj *) - 1) / sizeof(struct obj *);
+
+	t->nmap = (words + PTRMAP_BITS - 1) / PTRMAP_BITS;
+	t->ptrmap = calloc( t->nmap, sizeof(*t->ptrmap) );
+	if (!t->ptrmap)
+		die( 1, "type %d: ptrmap allocation failed", type );
+
+	int i;
+	for( i = 0; i < n; i++ ) {
+		size_t off = offsets[i];
+		if (off % sizeof(struct obj *) || off < first
+				|| off + sizeof(struct obj *) > size)
+			die( 1, "type %d: bad ptr offset %zu", type, off );
+
+		size_t w = off / sizeof(struct obj *);
+		t->ptrmap[ w / PTRMAP_BITS ] |= 1ul << (w % PTRMAP_BITS);
+	}
+}
+
+/* register a fixed-size type, with ptr fields at the given byte offsets */
+void type_register(int type, size_t size, size_t const * offsets, int n) {
+	type_check_free(type);
+	if (size < sizeof(struct obj))
+		die( 1, "type %d: size %zu is smaller than a gc header", type, size );
+
+	types[type].units = units_for(size);
+	type_map(type, size, sizeof(struct obj), offsets, n);
+}
+
+/* register a tiny type, whose objects have no header at all: the offsets
+ * are from the start of the object, and a ptr to one is a struct obj *
+ * only in name. size is rounded up to a power of two units, which can't
+ * be more than TINY_MAX_UNITS. */
+void type_register_tiny(int type, size_t size, size_t const * offsets, int n) {
+	type_check_free(type);
+	int units = 1;
+	while (units < units_for(size))
+		units *= 2;
+	if (!size || units > TINY_MAX_UNITS)
+		die( 1, "type %d: size %zu can't be tiny", type, size );
+
+	types[type].units = units;
+	types[type].tiny = 1;
+	type_map(type, size, 0, offsets, n);
+}
+
+/* register a type that needs code to find its size and/or ptrs. size is
+ * used if sizefn is null; trace may be null for types without ptrs. */
+void type_register_fn(int type, size_t size, size_fn sizefn, trace_fn trace) {
+	type_check_free(type);
+	if (!sizefn && size < sizeof(struct obj))
+		die( 1, "type %d: size %zu is smaller than a gc header", type, size );
+
+	struct type * t = &types[type];
+	t->units = sizefn ? 0 : units_for(size);
+	t->size = sizefn;
+	t->trace = trace;
+}
+
+static inline int obj_units(struct type * t, struct obj * o) {
+	if (__builtin_expect(t->units, 1))
+		return t->units;
+	if (!t->size)
+		die( 1, "broken GC: object %p has unregistered type %d", o, o->type );
+	return units_for(t->size(o));
+}
+
+static inline struct type * type_of(struct arena * a, struct obj * o) {
+	return &types[obj_type(a, o)];
+}
+
+/* tiny allocation ------------------------------------------------------- */
+
+static int type_is_tiny(int type) {
+	return types[type].tiny;
+}
+
+static struct arena * tiny_arena_new(int type) {
+	struct arena * a = arena_new();
+	a->c.kind = ARENA_TINY;
+	a->c.type = type;
+	a->c.units = types[type].units;
+	a->c.stride = ~(word_t)0 / (BIT(a->c.units) - 1);
+	a->a.nextcell = TINY_START;
+	memset( grays_of(a), 0, ARENA_WORDS * sizeof(word_t) );
+	return a;
+}
+
+/* the next free slot from nextcell on, or null. a slot's first cell is
+ * only free if the rest are. */
+static struct obj * tiny_arena_alloc(struct arena * a) {
+	if (a->c.swept != gc.epoch)
+		sweep(a);
+
+	size_t c = a->a.nextcell;
+	size_t w = c / WORD_BITS;
+	if (w >= ARENA_WORDS)
+		return 0;
+	word_t bits = ~a->used[w] & a->c.stride & (~(word_t)0 << (c % WORD_BITS));
+	while (!bits) {
+		if (++w == ARENA_WORDS) {
+			a->a.nextcell = ARENA_CELLS;
+			return 0;
+		}
+		bits = ~a->used[w] & a->c.stride;
+	}
+
+	c = w * WORD_BITS + __builtin_ctzl(bits);
+	use_cells(a, c, a->c.units);
+	a->a.nextcell = c + a->c.units;
+	return (struct obj *)((size_t)a + (c << UNIT_LOG2));
+}
+
+/* heap_alloc_locked, for a tiny type: the same, but with its own arenas */
+static struct obj * tiny_alloc(int type, size_t objsize) {
+	if (objsize > (size_t) types[type].units << UNIT_LOG2)
+		die( 1, "tiny type %d can't be %zu bytes", type, objsize );
+
+	struct arena * a = heap.tiny[type].current;
+	struct obj * o = a ? tiny_arena_alloc(a) : 0;
+	while (!o) {
+		if (minor_due()) {
+			gc_minor();
+			a = heap.tiny[type].current;
+			o = a ? tiny_arena_alloc(a) : 0;
+			continue;
+		}
+
+		a = heap_take_free(&heap.tiny[type].free);
+		if (!a)
+			a = tiny_arena_new(type);
+		heap.tiny[type].current = a;
+		if (generational())
+			nursery_add(a);
+		o = tiny_arena_alloc(a);
+	}
+
+	gc.allocated += objsize;
+	return o;
+}
+
+/* real meat ------------------------------------------------------------- */
+
+/* after writing a ptr field in an object, reachability can change, so make
+ * the object gray. if it is now dark-gray, push it back onto the gs for its
+ * arena. a white object will have all its fields scanned when it is
+ * reached, so it is left alone. */
+static void conc_barrier(struct obj * o);
+
+/* an old object may now point at a young one, so dirty its card. large
+ * objects are always old, and only have the one card. */
+static inline void remember(struct obj * o) {
+	struct arena * a = get_arena(o);
+	if (a->c.kind != ARENA_LARGE) {
+		size_t cell = CELL_OF(a, o);
+		if (!IS_OLD(a, cell))
+			return;
+		a->c.cards[cell / CARD_CELLS] = 1;
+	}
+
+	if (!a->c.dirty) {
+		a->c.dirty = 1;
+		a->c.dirtynext = heap.dirty;
+		heap.dirty = a;
+	}
+}
+
+void write_barrier(struct obj * o) {
+	if (heap.concurrent) {
+		conc_barrier(o);
+		return;
+	}
+
+	if (generational())
+		remember(o);
+
+	if (!gc_marking()) return;
+	STAT(barrier_stats.calls++);
+	struct arena * a = get_arena(o);
+	if (is_gray(a, o)) return;
+	size_t cell = CELL_OF(a, o);
+	if (IS_MARKED(a, cell)) {
+		set_gray(a, o, 1);
+		gs_push(a, o);
+		STAT(barrier_stats.pushes++);
+	}
+}
+
+/* make a white object gray, by pushing it onto its arena's gs */
+static inline void shade(struct obj * o) {
+	if (!o) return;
+	struct arena * a = get_arena(o);
+	if (is_gray(a, o) || IS_MARKED(a, CELL_OF(a, o))) return;
+	set_gray(a, o, 1);
+	gs_push(a, o);
+}
+
+static void visit_shade(struct obj ** slot) {
+	shade(*slot);
+}
+
+static void visit_evac(struct obj ** slot);
+
+/* roots and fields take the same path: when evacuating, a ptr into an
+ * arena being emptied is moved and the slot fixed up */
+static inline void shade_slot(struct obj ** slot) {
+	if (gc.evac)
+		visit_evac(slot);
+	else
+		shade(*slot);
+}
+
+/* visit every ptr slot of an object. visit is always a constant, so this
+ * gets inlined into a loop that calls it directly. */
+static inline void trace(struct type * t, struct obj * o, visit_fn visit) {
+	if (t->trace) {
+		t->trace(o, visit);
+		return;
+	}
+
+	struct obj ** slots = (struct obj **) o;
+	int i;
+	for( i = 0; i < t->nmap; i++ ) {
+		unsigned long m = t->ptrmap[i];
+		while (m) {
+			visit( &slots[ i * PTRMAP_BITS + __builtin_ctzl(m) ] );
+			m &= m - 1;
+		}
+	}
+}
+
+/* marking gathers mark bits a word at a time, and only writes them out
+ * when it moves on to another word, rather than going back to the same
+ * one for each object in it. the objects stay gray until then, so that
+ * nothing pushes them again, which means the batch has to be written
+ * out before the mutator runs. */
+static struct {
+	struct arena * a;	/* or null if there's nothing in it */
+	size_t w;		/* word of the mark bitmap */
+	word_t bits;		/* to mark in it */
+	word_t starts;		/* the first cells of the objects, to ungray */
+} batch;
+
+static void batch_flush(void) {
+	struct arena * a = batch.a;
+	if (!a) return;
+	word_t * m = &marks_of(a)[batch.w];
+	if (gc.sense)
+		*m &= ~batch.bits;
+	else
+		*m |= batch.bits;
+
+	word_t s = batch.starts;
+	while (s) {
+		size_t c = batch.w * WORD_BITS + __builtin_ctzl(s);
+		set_gray(a, (struct obj *)((size_t)a + (c << UNIT_LOG2)), 0);
+		s &= s - 1;
+	}
+	batch.a = 0;
+}
+
+/* mark n cells from c, of an object starting there. one that runs into
+ * the next word is marked straight away. */
+static inline void batch_mark(struct arena * a, struct obj * o, size_t c, int n) {
+	if (c % WORD_BITS + n > WORD_BITS) {
+		mark_cells(a, c, n);
+		set_gray(a, o, 0);
+		return;
+	}
+
+	if (batch.a != a || batch.w != c / WORD_BITS) {
+		batch_flush();
+		batch.a = a;
+		batch.w = c / WORD_BITS;
+		batch.bits = batch.starts = 0;
+	}
+	batch.bits |= n == WORD_BITS ? ~(word_t)0 : (BIT(n) - 1) << (c % WORD_BITS);
+	batch.starts |= BIT(c);
+}
+
+/* with heap.prefetch, the ptrs marking finds in an object wait in a
+ * ring, prefetched, until MARK_AHEAD more have been found, and only then
+ * get shaded, by when the header that shading tests and writes should be
+ * in the cache. marking isn't done until the ring is empty, and it is
+ * emptied at the end of every step, so the mutator never sees it. */
+#define MARK_AHEAD (16)
+
+static struct {
+	struct obj * o[MARK_AHEAD];
+	int head, n;
+	int on;			/* step_mark is marking through it */
+} ring;
+
+static inline void shade_ahead(struct obj * o) {
+	if (!o) return;
+	__builtin_prefetch( o, 1 );
+	if (ring.n < MARK_AHEAD) {
+		ring.o[ (ring.head + ring.n++) % MARK_AHEAD ] = o;
+		return;
+	}
+
+	struct obj * old = ring.o[ring.head];
+	ring.o[ring.head] = o;
+	ring.head = (ring.head + 1) % MARK_AHEAD;
+	shade(old);
+}
+
+static void visit_shade_ahead(struct obj ** slot) {
+	shade_ahead(*slot);
+}
+
+/* shade everything in the ring; returns 0 if it was empty */
+static int ring_flush(void) {
+	int n = ring.n;
+	while (ring.n) {
+		struct obj * o = ring.o[ring.head];
+		ring.head = (ring.head + 1) % MARK_AHEAD;
+		ring.n--;
+		shade(o);
+	}
+	return n;
+}
+
+/* make a gray object black, and shade what it points at */
+static void mark_obj(struct arena * a, struct obj * o) {
+	/* large objects only have a mark bit for their first cell */
+	struct type * t = type_of(a, o);
+	size_t c = CELL_OF(a, o);
+	if (!IS_MARKED(a, c))
+		gc.marked_bytes += (size_t) obj_units(t, o) << UNIT_LOG2;
+	batch_mark(a, o, c, a->c.kind != ARENA_LARGE ? obj_units(t, o) : 1);
+	STAT(stats.cur.marked++; stats.cur.marked_bytes += (size_t) obj_units(t, o) << UNIT_LOG2);
+
+	/* survivors of a major collection are all old */
+	if (generational() && a->c.kind != ARENA_LARGE)
+		SET_OLD(a, c);
+
+	if (gc.evac)
+		trace(t, o, visit_evac);
+	else if (ring.on)
+		trace(t, o, visit_shade_ahead);
+	else
+		trace(t, o, visit_shade);
+}
+
+/* pop the first object off an arena's gs, and mark it, leaving its mark
+ * bits in the batch for step_mark to write out */
+static int mark_batched(struct arena * a) {
+	struct obj * o = gs_pop(a);
+	if (!o) return 0;
+	mark_obj(a, o);
+	return 1;
+}
+
+/* the same, with its bits written out */
+int mark(struct arena * a) {
+	int n = mark_batched(a);
+	batch_flush();
+	return n;
+}
+
+/* the bitmap half of sweeping: used &= mark, and clear mark unless the
+ * marks are sticky, or in the side table and never cleared, with the
+ * arena's header words left alone. this is done a vector at a time where
+ * the target has vectors, with a SWAR popcount to count the cells that
+ * were used and those still live. returns the number of cells freed. */
+static int sweep_bits(struct arena * a, int * nlive, int sticky) {
+	size_t i = ARENA_HDR_UNITS / WORD_BITS;
+	int nused = 0, nl = 0;
+	word_t * mark = marks_of(a);
+	word_t sense = gc.sense;
+
+#if defined(__AVX2__)
+#define VEC_WORDS (sizeof(__m256i) / sizeof(word_t))
+	__m256i const m1 = _mm256_set1_epi8(0x55);
+	__m256i const m2 = _mm256_set1_epi8(0x33);
+	__m256i const m4 = _mm256_set1_epi8(0x0f);
+	__m256i const zero = _mm256_setzero_si256();
+	__m256i const flip = _mm256_set1_epi8( (char) sense );
+	__m256i cu = zero, cl = zero;
+
+#define POPCNT(x) ({ \
+		__m256i _x = (x); \
+		_x = _mm256_sub_epi8(_x, _mm256_and_si256(_mm256_srli_epi16(_x, 1), m1)); \
+		_x = _mm256_add_epi8(_mm256_and_si256(_x, m2), \
+				_mm256_and_si256(_mm256_srli_epi16(_x, 2), m2)); \
+		_x = _mm256_and_si256(_mm256_add_epi8(_x, _mm256_srli_epi16(_x, 4)), m4); \
+		_mm256_sad_epu8(_x, zero); })
+
+	/* a whole number of vectors, so the tail is seen to start in bounds */
+	size_t vec_end = i + (ARENA_WORDS - i) / VEC_WORDS * VEC_WORDS;
+	for( ; i < vec_end; i += VEC_WORDS ) {
+		__m256i u = _mm256_loadu_si256( (__m256i *) &a->used[i] );
+		__m256i m = _mm256_xor_si256( _mm256_loadu_si256( (__m256i *) &mark[i] ), flip );
+		__m256i l = _mm256_and_si256( u, m );
+		_mm256_storeu_si256( (__m256i *) &a->used[i], l );
+		if (!sticky)
+			_mm256_storeu_si256( (__m256i *) &mark[i], zero );
+		cu = _mm256_add_epi64( cu, POPCNT(u) );
+		cl = _mm256_add_epi64( cl, POPCNT(l) );
+	}
+
+	long long su[4], sl[4];
+	_mm256_storeu_si256( (__m256i *) su, cu );
+	_mm256_storeu_si256( (__m256i *) sl, cl );
+	nused += su[0] + su[1] + su[2] + su[3];
+	nl += sl[0] + sl[1] + sl[2] + sl[3];
+#undef POPCNT
+#undef VEC_WORDS
+#elif defined(__SSE2__)
+#define VEC_WORDS (sizeof(__m128i) / sizeof(word_t))
+	__m128i const m1 = _mm_set1_epi8(0x55);
+	__m128i const m2 = _mm_set1_epi8(0x33);
+	__m128i const m4 = _mm_set1_epi8(0x0f);
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const flip = _mm_set1_epi8( (char) sense );
+	__m128i cu = zero, cl = zero;
+
+#define POPCNT(x) ({ \
+		__m128i _x = (x); \
+		_x = _mm_sub_epi8(_x, _mm_and_si128(_mm_srli_epi16(_x, 1), m1)); \
+		_x = _mm_add_epi8(_mm_and_si128(_x, m2), \
+				_mm_and_si128(_mm_srli_epi16(_x, 2), m2)); \
+		_x = _mm_and_si128(_mm_add_epi8(_x, _mm_srli_epi16(_x, 4)), m4); \
+		_mm_sad_epu8(_x, zero); })
+
+	size_t vec_end = i + (ARENA_WORDS - i) / VEC_WORDS * VEC_WORDS;
+	for( ; i < vec_end; i += VEC_WORDS ) {
+		__m128i u = _mm_loadu_si128( (__m128i *) &a->used[i] );
+		__m128i m = _mm_xor_si128( _mm_loadu_si128( (__m128i *) &mark[i] ), flip );
+		__m128i l = _mm_and_si128( u, m );
+		_mm_storeu_si128( (__m128i *) &a->used[i], l );
+		if (!sticky)
+			_mm_storeu_si128( (__m128i *) &mark[i], zero );
+		cu = _mm_add_epi64( cu, POPCNT(u) );
+		cl = _mm_add_epi64( cl, POPCNT(l) );
+	}
+
+	long long su[2], sl[2];
+	_mm_storeu_si128( (__m128i *) su, cu );
+	_mm_storeu_si128( (__m128i *) sl, cl );
+	nused += su[0] + su[1];
+	nl += sl[0] + sl[1];
+#undef POPCNT
+#undef VEC_WORDS
+#elif defined(__ARM_NEON)
+#define VEC_WORDS (sizeof(uint8x16_t) / sizeof(word_t))
+	uint16x8_t cu = vdupq_n_u16(0), cl = vdupq_n_u16(0);
+	uint8x16_t const flip = vdupq_n_u8( (uint8_t) sense );
+
+	size_t vec_end = i + (ARENA_WORDS - i) / VEC_WORDS * VEC_WORDS;
+	for( ; i < vec_end; i += VEC_WORDS ) {
+		uint8x16_t u = vld1q_u8( (uint8_t *) &a->used[i] );
+		uint8x16_t m = veorq_u8( vld1q_u8( (uint8_t *) &mark[i] ), flip );
+		uint8x16_t l = vandq_u8( u, m );
+		vst1q_u8( (uint8_t *) &a->used[i], l );
+		if (!sticky)
+			vst1q_u8( (uint8_t *) &mark[i], vdupq_n_u8(0) );
+		cu = vpadalq_u8( cu, vcntq_u8(u) );
+		cl = vpadalq_u8( cl, vcntq_u8(l) );
+	}
+
+	uint64x2_t su = vpaddlq_u32( vpaddlq_u16(cu) );
+	uint64x2_t sl = vpaddlq_u32( vpaddlq_u16(cl) );
+	nused += vgetq_lane_u64(su, 0) + vgetq_lane_u64(su, 1);
+	nl += vgetq_lane_u64(sl, 0) + vgetq_lane_u64(sl, 1);
+#undef VEC_WORDS
+#endif
+
+	/* whatever is left, or everything if there are no vectors */
+	for( ; i < ARENA_WORDS; i++ ) {
+		word_t used = a->used[i];
+		word_t live = used & (mark[i] ^ sense);
+
+		nused += __builtin_popcountl(used);
+		nl += __builtin_popcountl(live);
+		if (!sticky)
+			mark[i] = 0;
+		a->used[i] = live;
+	}
+
+	*nlive = nl;
+	return nused - nl;
+}
+
+/* sweep away all unmarked objects remaining in an arena, and get it ready
+ * for the next cycle. returns the number of cells freed. */
+int sweep(struct arena * a) {
+	if (a->a.gs && a->a.gs->n)
+		die( 1, "broken GC: arena %p had things remaining to mark", a);
+
+	int nlive;
+	int sticky = generational();
+	int freed = sweep_bits(a, &nlive, sticky || gc.side);
+	STAT_ADD(swept, 1);
+
+	if (freed) {
+		size_t i;
+		for( i = ARENA_HDR_UNITS / WORD_BITS; i < ARENA_WORDS; i++ )
+			a->starts[i] &= a->used[i];
+	}
+	STAT_ADD(freed_bytes, (size_t) freed << UNIT_LOG2);
+
+	/* the dead lose their old bits. if marks aren't being kept, old
+	 * bits mean nothing, and would only trip up a later minor. */
+	if (a->c.hasold) {
+		size_t i;
+		for( i = ARENA_HDR_UNITS / WORD_BITS; i < ARENA_WORDS; i++ )
+			a->old[i] = sticky ? a->old[i] & a->mark[i] : 0;
+		a->c.hasold = sticky;
+	}
+	gc.sticky |= sticky;
+
+	a->c.swept = gc.epoch;
+
+	if (a->c.kind == ARENA_TINY) {
+		/* allocation only looks for free slots, so all it needs is
+		 * to start from the bottom again */
+		a->a.nextcell = TINY_START;
+		if (ARENA_CELLS - TINY_START - nlive >= ARENA_REUSE_CELLS)
+			heap_add_free(a);
+	} else if (heap.fit == FIT_BUMP) {
+		/* allocation only bumps, so an arena is only worth going
+		 * back to once it is completely empty */
+		if (!nlive && a->a.nextcell != ARENA_HDR_UNITS) {
+			a->a.nextcell = ARENA_HDR_UNITS;
+			heap_add_free(a);
+		}
+	} else {
+		/* start looking again from the bottom of the arena. the free
+		 * lists would be written into the free cells, so a freshly
+		 * mapped arena goes without until its next sweep. */
+		a->a.nextcell = ARENA_HDR_UNITS;
+		if (use_size_classes() && !a->c.pristine)
+			fl_rebuild(a);
+		a->c.pristine = 0;
+		if (ARENA_CELLS - ARENA_HDR_UNITS - nlive >= ARENA_REUSE_CELLS)
+			heap_add_free(a);
+	}
+	return freed;
+}
+
+/* roots ----------------------------------------------------------------- */
+
+static struct obj *** roots = 0;
+static size_t nroots = 0, roots_cap = 0;
+
+/* only matters with mutator threads; see the concurrent marking section */
+static pthread_mutex_t roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* roots and pins are scanned once a cycle, a few at a time, so while
+ * marking, whatever goes into one has to be shaded as it does. (with
+ * concurrent marking, the collector reads them all again instead.) */
+static inline void root_barrier(struct obj ** slot) {
+	if (!gc_marking() || heap.concurrent)
+		return;
+	/* evacuating allocates the copy, which mustn't go off and assist
+	 * in the middle of it */
+	int stepping = gc.stepping;
+	gc.stepping = 1;
+	shade_slot(slot);
+	gc.stepping = stepping;
+}
+
+/* register a slot that holds a ptr to a live object (or null) */
+void gc_add_root(struct obj ** slot) {
+	pthread_mutex_lock( &roots_lock );
+	if (nroots == roots_cap) {
+		roots_cap = roots_cap ? 2 * roots_cap : 64;
+		roots = realloc( roots, roots_cap * sizeof(*roots) );
+		if (!roots)
+			die( 1, "root table allocation failed" );
+	}
+	roots[nroots++] = slot;
+	root_barrier(slot);
+	pthread_mutex_unlock( &roots_lock );
+}
+
+void gc_remove_root(struct obj ** slot) {
+	size_t i;
+	pthread_mutex_lock( &roots_lock );
+	for( i = 0; i < nroots; i++ )
+		if (roots[i] == slot) {
+			/* the last root may be moving to where the collector
+			 * has already been */
+			roots[i] = roots[--nroots];
+			if (i < nroots)
+				root_barrier(roots[i]);
+
+			/* and the pins, numbered after the roots, all move
+			 * down one under the cursor */
+			if (gc.phase == GC_ROOTS && gc.root_cursor > nroots)
+				gc.root_cursor--;
+			break;
+		}
+	pthread_mutex_unlock( &roots_lock );
+}
+
+/* call after storing into a registered root slot, as write_barrier is
+ * called after storing into an object */
+void gc_root_barrier(struct obj ** slot) {
+	root_barrier(slot);
+}
+
+/* pinned handles are roots for code outside the gc's reach, which also
+ * hangs on to the object's address: the object stays where it is for as
+ * long as the handle is held. the table is indexed by handle, and free
+ * entries are chained through it. */
+typedef size_t gc_handle;
+
+struct pin {
+	struct obj * obj;
+	size_t nextfree;	/* next free handle, plus one */
+	int used;
+};
+
+static struct pin * pins = 0;
+static size_t npins = 0, pins_cap = 0, pins_free = 0;
+
+gc_handle gc_pin(struct obj * o) {
+	pthread_mutex_lock( &roots_lock );
+	size_t h;
+	if (pins_free) {
+		h = pins_free - 1;
+		pins_free = pins[h].nextfree;
+	} else {
+		if (npins == pins_cap) {
+			pins_cap = pins_cap ? 2 * pins_cap : 64;
+			pins = realloc( pins, pins_cap * sizeof(*pins) );
+			if (!pins)
+				die( 1, "pin table allocation failed" );
+		}
+		h = npins++;
+	}
+	pins[h].obj = o;
+	pins[h].used = 1;
+	root_barrier(&pins[h].obj);
+	pthread_mutex_unlock( &roots_lock );
+	return h;
+}
+
+struct obj * gc_pinned(gc_handle h) {
+	pthread_mutex_lock( &roots_lock );
+	if (h >= npins || !pins[h].used)
+		die( 1, "gc_pinned: handle %zu isn't pinned", h );
+	struct obj * o = pins[h].obj;
+	pthread_mutex_unlock( &roots_lock );
+	return o;
+}
+
+void gc_unpin(gc_handle h) {
+	pthread_mutex_lock( &roots_lock );
+	if (h >= npins || !pins[h].used)
+		die( 1, "gc_unpin: handle %zu isn't pinned", h );
+	pins[h].obj = 0;
+	pins[h].used = 0;
+	pins[h].nextfree = pins_free;
+	pins_free = h + 1;
+	pthread_mutex_unlock( &roots_lock );
+}
+
+/* the shadow stack: a thread's locals are roots for as long as the frame
+ * listing them is pushed. frames live on the c stack, and are popped in
+ * the reverse order they were pushed in, before the function pushing
+ * them returns:
+ *
+ *	struct obj * a = 0, * b = 0;
+ *	struct gc_frame f = { .n = 2, .slots = { &a, &b } };
+ *	gc_frame_push( &f );
+ *	...
+ *	gc_frame_pop( &f );
+ */
+#define GC_FRAME_SLOTS (8)
+
+struct gc_frame {
+	struct gc_frame * prev;
+	int n;
+	struct obj ** slots[GC_FRAME_SLOTS];
+};
+
+static __thread struct gc_frame * gc_frames;
+
+void gc_frame_push(struct gc_frame * f) {
+	if (f->n < 0 || f->n > GC_FRAME_SLOTS)
+		die( 1, "gc_frame_push: frame has %d slots", f->n );
+	f->prev = gc_frames;
+	gc_frames = f;
+}
+
+void gc_frame_pop(struct gc_frame * f) {
+	if (gc_frames != f)
+		die( 1, "gc_frame_pop: frame %p isn't the top one", (void *) f );
+	gc_frames = f->prev;
+}
+
+/* conservative roots: with heap.conservative set, any word on a thread's
+ * stack, or in its registers, that points into an object is a root. the
+ * object can't be told from a ptr, so it is never moved. */
+
+/* the object w points into, if any */
+static struct obj * conservative_find(word_t w) {
+	struct arena * a = index_find((void *) w);
+	if (!a)
+		return 0;
+
+	struct obj * first = (struct obj *)((char *) a + ARENA_HDR_UNITS * ALLOC_UNIT);
+	if (a->c.kind == ARENA_LARGE)
+		return w >= (word_t) first ? first : 0;
+
+	size_t cell = CELL_OF(a, w);
+	if (a->c.kind == ARENA_TINY) {
+		cell &= ~(size_t)(a->c.units - 1);
+		if (cell < TINY_START || !IS_USED(a, cell))
+			return 0;
+		return (struct obj *)((char *) a + (cell << UNIT_LOG2));
+	}
+	if (cell < ARENA_HDR_UNITS || !IS_USED(a, cell))
+		return 0;
+
+	/* objects are runs of used cells, so it is the one with the last
+	 * start at or before the cell */
+	size_t i = cell / WORD_BITS;
+	word_t m = a->starts[i] & (BIT(cell) | (BIT(cell) - 1));
+	while (!m && i > ARENA_HDR_UNITS / WORD_BITS)
+		m = a->starts[--i];
+	if (!m)
+		return 0;
+	size_t c = i * WORD_BITS + (WORD_BITS - 1 - __builtin_clzl(m));
+	return (struct obj *)((char *) a + (c << UNIT_LOG2));
+}
+
+static void __noasan conservative_range(void const * lo, void const * hi, visit_fn visit) {
+	word_t const * w = (word_t const *)(((size_t) lo + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1));
+	for( ; (void const *)(w + 1) <= hi; w++ ) {
+		struct obj * o = conservative_find(*w);
+		if (o)
+			visit(&o);	/* not moved, so nothing to fix up */
+	}
+}
+
+/* top end of this thread's stack */
+static __thread char * stack_hi;
+
+static char * stack_base(void) {
+	if (stack_hi)
+		return stack_hi;
+
+	pthread_attr_t attr;
+	void * addr;
+	size_t size;
+	if (pthread_getattr_np( pthread_self(), &attr )
+			|| pthread_attr_getstack( &attr, &addr, &size ))
+		die( 1, "can't find the stack to scan" );
+	pthread_attr_destroy( &attr );
+	stack_hi = (char *) addr + size;
+	return stack_hi;
+}
+
+/* the running thread's stack, from a local of the innermost frame up */
+static void __attribute__((noinline)) stack_scan_here(visit_fn visit) {
+	char here = 0;
+	conservative_range( &here, stack_base(), visit );
+}
+
+/* the running thread's stack, with its registers. __builtin_unwind_init
+ * spills every callee-saved register into this frame, which is above
+ * stack_scan_here's. (setjmp won't do: glibc mangles the frame and stack
+ * ptrs in a jmp_buf.) */
+static void __attribute__((noinline)) stack_scan(visit_fn visit) {
+	__builtin_unwind_init();
+	stack_scan_here(visit);
+	__asm__ volatile( "" ::: "memory" );	/* not a tail call */
+}
+
+/* the global roots and the pinned handles are numbered together, so the
+ * collector can work through them a few at a time. null for a free
+ * handle. */
+static inline size_t nroot_slots(void) {
+	return nroots + npins;
+}
+
+static inline struct obj ** root_slot(size_t i) {
+	if (i < nroots)
+		return roots[i];
+	i -= nroots;
+	return pins[i].used ? &pins[i].obj : 0;
+}
+
+/* this thread's frames, and its stack if that is scanned too. they come
+ * and go between collector steps, and stores into them have no barrier,
+ * so they are only visited all at once. returns the slots visited. */
+static size_t frames_visit(visit_fn visit) {
+	struct gc_frame * f;
+	size_t n = 0;
+	int j;
+	for( f = gc_frames; f; f = f->prev )
+		for( j = 0; j < f->n; j++, n++ )
+			visit(f->slots[j]);
+
+	if (heap.conservative)
+		stack_scan(visit);
+	return n;
+}
+
+/* every root there is, for this thread */
+static void roots_visit(visit_fn visit) {
+	size_t i;
+	for( i = 0; i < nroot_slots(); i++ ) {
+		struct obj ** slot = root_slot(i);
+		if (slot)
+			visit(slot);
+	}
+	frames_visit(visit);
+}
+
+/* parallel marking ------------------------------------------------------
+ *
+ * when a whole mark phase is wanted at once (gc_collect), it can be split
+ * across heap.mark_threads threads. the arenas' gray stacks are broken up
+ * into their chunks and dealt out to the workers, and from then on each
+ * worker pushes what it shades onto a chunk of its own rather than onto
+ * the arenas. full chunks are put on the worker's deque, which idle
+ * workers steal whole chunks from (Chase and Lev's work-stealing deque).
+ * marking is over when every worker is idle at once, since only a busy
+ * worker can make more work, and it can't go idle with any left.
+ *
+ * the mark bitmaps and gray bits are updated with atomics. two workers
+ * can both shade an object if one is between setting its mark bits and
+ * clearing its gray bit as the other looks, but that only costs a second
+ * trace.
+ */
+
+#define DEQUE_SIZE (4096)
+
+struct deque {
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+	struct gs * buf[DEQUE_SIZE];
+};
+
+struct worker {
+	struct deque dq;
+	struct gs * cur;	/* chunk this worker pushes and pops */
+	struct gs * private;	/* chunks there was no room in dq for */
+	size_t work;
+	size_t bytes;		/* marked */
+	unsigned seed;		/* for picking victims */
+	pthread_t thread;
+};
+
+static struct {
+	struct worker * w;
+	int n;
+	int idle;		/* workers with nothing to do */
+} par;
+
+static __thread struct worker * par_self;
+
+/* owner only */
+static int deque_push(struct deque * d, struct gs * gs) {
+	long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED );
+	long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+	if (b - t >= DEQUE_SIZE)
+		return 0;
+	__atomic_store_n( &d->buf[b % DEQUE_SIZE], gs, __ATOMIC_RELAXED );
+	__atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELEASE );
+	return 1;
+}
+
+/* owner only */
+static struct gs * deque_pop(struct deque * d) {
+	long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED ) - 1;
+	__atomic_store_n( &d->bottom, b, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	long t = __atomic_load_n( &d->top, __ATOMIC_RELAXED );
+
+	struct gs * gs = 0;
+	if (t <= b) {
+		gs = __atomic_load_n( &d->buf[b % DEQUE_SIZE], __ATOMIC_RELAXED );
+		if (t == b) {
+			/* last one; race any thieves for it */
+			if (!__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED ))
+				gs = 0;
+			__atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+		}
+	} else
+		__atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+	return gs;
+}
+
+/* anyone */
+static struct gs * deque_steal(struct deque * d) {
+	long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	long b = __atomic_load_n( &d->bottom, __ATOMIC_ACQUIRE );
+	if (t >= b)
+		return 0;
+
+	struct gs * gs = __atomic_load_n( &d->buf[t % DEQUE_SIZE], __ATOMIC_RELAXED );
+	if (!__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED ))
+		return 0;
+	return gs;
+}
+
+static inline int deque_empty(struct deque * d) {
+	return __atomic_load_n( &d->top, __ATOMIC_ACQUIRE )
+		>= __atomic_load_n( &d->bottom, __ATOMIC_ACQUIRE );
+}
+
+/* the gray bit shares a byte with the type, so it has to be changed with
+ * atomic ops on the whole byte. gcc allocates bitfields from the low bit
+ * on little-endian targets, and from the high bit on big-endian ones. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define OBJ_GRAY_BIT (0x01)
+#else
+#define OBJ_GRAY_BIT (0x80)
+#endif
+
+/* set the gray bit, and return what it was */
+static inline int obj_gray_atomic(struct arena * a, struct obj * o) {
+	if (a->c.kind == ARENA_TINY) {
+		size_t c = CELL_OF(a, o);
+		return !!(__atomic_fetch_or( &grays_of(a)[c / WORD_BITS], BIT(c),
+				__ATOMIC_RELAXED ) & BIT(c));
+	}
+	return __atomic_fetch_or( (unsigned char *) o, OBJ_GRAY_BIT,
+			__ATOMIC_RELAXED ) & OBJ_GRAY_BIT;
+}
+
+static inline void obj_ungray_atomic(struct arena * a, struct obj * o) {
+	if (a->c.kind == ARENA_TINY) {
+		size_t c = CELL_OF(a, o);
+		__atomic_fetch_and( &grays_of(a)[c / WORD_BITS], ~BIT(c), __ATOMIC_RELAXED );
+		return;
+	}
+	__atomic_fetch_and( (unsigned char *) o, (unsigned char) ~OBJ_GRAY_BIT,
+			__ATOMIC_RELAXED );
+}
+
+static void par_publish(struct worker * w, struct gs * gs) {
+	if (!deque_push(&w->dq, gs)) {
+		gs->prev = w->private;
+		w->private = gs;
+	}
+}
+
+static inline void par_push(struct worker * w, struct obj * o) {
+	struct gs * gs = w->cur;
+	if (gs->n == GS_SIZE) {
+		par_publish(w, gs);
+		gs = w->cur = gs_get();
+		gs->n = 0;
+	}
+	gs->data[ GS_SIZE - ++gs->n ] = o;
+}
+
+static struct gs * par_steal(struct worker * w) {
+	int i;
+	for( i = 0; i < par.n; i++ ) {
+		w->seed = w->seed * 1103515245 + 12345;
+		struct worker * v = &par.w[ (w->seed >> 16) % par.n ];
+		struct gs * gs = v == w ? 0 : deque_steal(&v->dq);
+		if (gs)
+			return gs;
+	}
+	return 0;
+}
+
+/* swap the worker's empty chunk for one with something in it */
+static int par_refill(struct worker * w) {
+	struct gs * gs = w->private;
+	if (gs)
+		w->private = gs->prev;
+	else if (!(gs = deque_pop(&w->dq)) && !(gs = par_steal(w)))
+		return 0;
+
+	gs_put(w->cur);
+	w->cur = gs;
+	return 1;
+}
+
+/* some worker is idle; give it something to steal, if we can spare it */
+static void par_share(struct worker * w) {
+	if (!deque_empty(&w->dq))
+		return;
+
+	if (w->private) {
+		struct gs * gs = w->private;
+		w->private = gs->prev;
+		par_publish(w, gs);
+	} else if (w->cur->n > 2 * 64) {
+		struct gs * gs = gs_get();
+		struct gs * cur = w->cur;
+		gs->n = cur->n / 2;
+		memcpy( &gs->data[GS_SIZE - gs->n], &cur->data[GS_SIZE - cur->n],
+				gs->n * sizeof(*gs->data) );
+		cur->n -= gs->n;
+		par_publish(w, gs);
+	}
+}
+
+static inline void par_shade(struct obj * o) {
+	if (!o) return;
+	struct arena * a = get_arena(o);
+	if (is_marked_atomic(a, CELL_OF(a, o)) || obj_gray_atomic(a, o))
+		return;
+	par_push(par_self, o);
+}
+
+/* in concurrent mode, mutators can be writing the slot */
+static void visit_par_shade(struct obj ** slot) {
+	par_shade(__atomic_load_n( slot, __ATOMIC_RELAXED ));
+}
+
+static inline void par_mark(struct obj * o) {
+	struct arena * a = get_arena(o);
+	struct type * t = type_of(a, o);
+	mark_cells_atomic(a, CELL_OF(a, o),
+			a->c.kind != ARENA_LARGE ? obj_units(t, o) : 1);
+	obj_ungray_atomic(a, o);
+	par_self->bytes += (size_t) obj_units(t, o) << UNIT_LOG2;
+
+	if (generational() && a->c.kind != ARENA_LARGE) {
+		size_t c = CELL_OF(a, o);
+		__atomic_fetch_or( &a->old[c / WORD_BITS], BIT(c), __ATOMIC_RELAXED );
+		a->c.hasold = 1;
+	}
+
+	/* pairs with the fence in conc_barrier: either it sees this
+	 * object gray or black and pushes it again, or the slots read
+	 * below have its store in them */
+	if (heap.concurrent)
+		__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	trace(t, o, visit_par_shade);
+}
+
+/* go idle, and wait for either work to steal or everyone else to be idle
+ * too. returns 1 when marking is finished. */
+static int par_wait(struct worker * w) {
+	__atomic_add_fetch( &par.idle, 1, __ATOMIC_SEQ_CST );
+	for (;;) {
+		if (__atomic_load_n( &par.idle, __ATOMIC_SEQ_CST ) == par.n)
+			return 1;
+
+		int i;
+		for( i = 0; i < par.n; i++ )
+			if (!deque_empty(&par.w[i].dq))
+				break;
+
+		if (i < par.n) {
+			/* stop being idle before holding any work, so nobody
+			 * can see everyone idle while we have some */
+			__atomic_sub_fetch( &par.idle, 1, __ATOMIC_SEQ_CST );
+			if (par_refill(w))
+				return 0;
+			__atomic_add_fetch( &par.idle, 1, __ATOMIC_SEQ_CST );
+		}
+		sched_yield();
+	}
+}
+
+static void * par_worker(void * arg) {
+	struct worker * w = arg;
+	par_self = w;
+
+	do {
+		while (w->cur->n || par_refill(w)) {
+			struct gs * gs = w->cur;
+			par_mark( gs->data[ GS_SIZE - gs->n-- ] );
+			if (!(++w->work & 63) && __atomic_load_n( &par.idle, __ATOMIC_RELAXED ))
+				par_share(w);
+		}
+	} while (!par_wait(w));
+
+	if (w != par.w)
+		gs_cache_flush();
+	return 0;
+}
+
+/* drain every gray stack in the heap, plus the list of chunks in extra,
+ * with n threads. returns the number of objects marked. */
+static size_t mark_parallel(int n, struct gs * extra) {
+	struct worker * w = calloc( n, sizeof(*w) );
+	if (!w)
+		die( 1, "worker allocation failed" );
+
+	par.w = w;
+	par.n = n;
+	par.idle = 0;
+
+	/* deal out the arenas' chunks */
+	int i = 0;
+	while (gc.gray) {
+		struct arena * a = gc.gray;
+		gc.gray = a->b.graynext;
+		a->b.ongray = 0;
+
+		while (a->a.gs) {
+			struct gs * gs = a->a.gs;
+			a->a.gs = gs->prev;
+			par_publish(&w[i++ % n], gs);
+		}
+	}
+
+	while (extra) {
+		struct gs * gs = extra;
+		extra = gs->prev;
+		par_publish(&w[i++ % n], gs);
+	}
+
+	for( i = 0; i < n; i++ ) {
+		w[i].cur = gs_get();
+		w[i].cur->n = 0;
+		w[i].seed = i + 1;
+	}
+
+	for( i = 1; i < n; i++ )
+		if (pthread_create( &w[i].thread, 0, par_worker, &w[i] ))
+			die( 1, "failed to start mark thread" );
+	par_worker(&w[0]);
+
+	size_t work = w[0].work;
+	gs_put(w[0].cur);
+	for( i = 1; i < n; i++ ) {
+		pthread_join( w[i].thread, 0 );
+		work += w[i].work;
+		gs_put(w[i].cur);
+	}
+
+	STAT_ADD(marked, work);
+	for( i = 0; i < n; i++ ) {
+		gc.marked_bytes += w[i].bytes;
+		STAT_ADD(marked_bytes, w[i].bytes);
+	}
+	free( w );
+	par.w = 0;
+	return work;
+}
+
+/* collector driver ------------------------------------------------------ */
+
+/* a budget for doing all the work there is */
+#define GC_UNBOUNDED ((size_t) -1)
+
+/* work charged for sweeping one arena; about one unit per bitmap word */
+#define SWEEP_WORK (ARENA_SIZE / ALLOC_UNIT / 32)
+
+static inline enum gc_phase gc_get_phase(void) {
+	return gc.phase;
+}
+
+/* a large root set is shaded a few at a time. it only needs the one
+ * pass: anything stored into a root after it was shaded is shaded by
+ * root_barrier. */
+static size_t step_roots(size_t budget) {
+	size_t work = 0;
+	while (work < budget && gc.root_cursor < nroot_slots()) {
+		struct obj ** slot = root_slot(gc.root_cursor++);
+		if (slot)
+			shade_slot(slot);
+		work++;
+	}
+	if (gc.root_cursor >= nroot_slots())
+		gc.phase = GC_MARK;
+	return work;
+}
+
+/* frames are plain memory, and the mutator may have moved ptrs into them
+ * since they were scanned, so they get shaded again once the gray stacks
+ * run dry. marking is only done when that finds nothing new. */
+static void pace_marked(void);
+
+static void start_sweep(void) {
+	gc.drain = 0;
+	pace_marked();
+	gs_trim(GS_POOL_HIGH);
+	gc.phase = GC_SWEEP;
+	gc.lazy = heap.lazy_sweep;
+	gc.epoch++;
+	gc.sweep_cursor = heap.arenas;
+	gc.sweep_large = &heap.large;
+}
+
+static void evac_release(void);
+
+static void visit_shade_slot(struct obj ** slot) {
+	shade_slot(slot);
+}
+
+static size_t finish_mark(void) {
+	size_t work = frames_visit(visit_shade_slot) + 1;
+
+	if (!gc.gray) {
+		gc.phase = GC_WEAK;
+		gc.weak_cursor = 0;
+	}
+	return work;
+}
+
+static size_t step_mark(size_t budget) {
+	size_t work = 0;
+	if (budget == GC_UNBOUNDED && heap.mark_threads > 1 && gc.gray && !gc.evac)
+		work = mark_parallel(heap.mark_threads, 0);
+
+	/* evacuation fixes up slots as it goes, which the ring can't */
+	ring.on = heap.prefetch && !gc.evac;
+	while (work < budget) {
+		/* stay with the arena being drained while it has grays, as
+		 * its gs and mark bits are in the cache, and only then go by
+		 * the list, which has the most recently grayed first */
+		struct arena * a = gc.drain && gc.drain->a.gs ? gc.drain : gc.gray;
+		if (!a) {
+			if (ring_flush())
+				continue;
+			ring.on = 0;
+			batch_flush();
+			return work + finish_mark();
+		}
+
+		gc.drain = a;
+		if (mark_batched(a)) {
+			work++;
+			continue;
+		}
+
+		/* drained, and so the head of the list. it only ever comes off
+		 * the list at the head, so an arena which empties while others
+		 * are pushed in front of it stays listed until it is reached
+		 * again. */
+		gc.gray = a->b.graynext;
+		a->b.ongray = 0;
+		gc.drain = 0;
+	}
+	ring_flush();
+	ring.on = 0;
+	batch_flush();
+	return work;
+}
+
+/* with lazy sweeping, the cycle is over once the large objects are done,
+ * and heap_alloc sweeps arenas as it looks for room. */
+static size_t step_sweep(size_t budget) {
+	size_t work = 0;
+	while (work < budget && gc.sweep_cursor && !gc.lazy) {
+		struct arena * a = gc.sweep_cursor;
+		gc.sweep_cursor = a->c.next;
+		if (a->c.swept != gc.epoch && !a->c.owned) {
+			sweep(a);
+			work += SWEEP_WORK;
+		}
+	}
+
+	/* large objects made since marking finished are already swept, so
+	 * it doesn't matter that they go in at the head */
+	while (work < budget && *gc.sweep_large) {
+		struct arena * a = *gc.sweep_large;
+		if (a->c.swept == gc.epoch)
+			gc.sweep_large = &a->c.next;
+		else {
+			struct arena * next = a->c.next;
+			if (large_sweep(a))
+				*gc.sweep_large = next;
+			else
+				gc.sweep_large = &a->c.next;
+			work++;
+		}
+	}
+
+	if ((gc.lazy || !gc.sweep_cursor) && !*gc.sweep_large)
+		gc.phase = GC_IDLE;
+	return work;
+}
+
+/* finish whatever sweeping is left from the last cycle, lazy or not */
+static void sweep_all(void) {
+	while (gc.phase != GC_IDLE) {
+		gc.lazy = 0;
+		step_sweep(GC_UNBOUNDED);
+	}
+	while (gc.sweep_cursor) {
+		struct arena * a = gc.sweep_cursor;
+		gc.sweep_cursor = a->c.next;
+		if (a->c.swept != gc.epoch)
+			sweep(a);
+	}
+}
+
+/* a major collection has to start from white. only needed once a
+ * generational sweep has kept marks. */
+static void clear_sticky_marks(void) {
+	if (!gc.sticky)
+		return;
+
+	struct arena * a;
+	size_t hdr = ARENA_HDR_UNITS / WORD_BITS;
+	for( a = heap.arenas; a; a = a->c.next )
+		memset( &a->mark[hdr], 0, (ARENA_WORDS - hdr) * sizeof(word_t) );
+	gc.sticky = 0;
+}
+
+/* switch over to side table marks, as a cycle starts: everything used is
+ * marked in the new bits, just as it would be after a cycle with them.
+ * there is no switching back. */
+static void side_marks_start(void) {
+	if (gc.side || !heap.side_marks || !region.base)
+		return;
+
+	size_t bytes = (size_t)(region.end - region.base) / ARENA_SIZE
+		* ARENA_WORDS * sizeof(word_t);
+	void * m = mmap( 0, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if (m == MAP_FAILED)
+		return;
+	region.marks = m;
+	gc.side = 1;
+	gc.sense = 0;
+
+	struct arena * a;
+	size_t hdr = ARENA_HDR_UNITS / WORD_BITS;
+	for( a = heap.arenas; a; a = a->c.next )
+		memcpy( &marks_of(a)[hdr], &a->used[hdr], (ARENA_WORDS - hdr) * sizeof(word_t) );
+	for( a = heap.large; a; a = a->c.next )
+		MARK(a, ARENA_HDR_UNITS);
+}
+
+/* a cycle has to start from white: with side marks, by flipping what the
+ * bits mean, otherwise by clearing marks only a generational sweep has
+ * kept. */
+static void start_marks(void) {
+	stats_roll();
+	gc.marked_bytes = 0;
+	clear_sticky_marks();
+	side_marks_start();
+	if (gc.side)
+		gc.sense = ~gc.sense;
+}
+
+/* weak slots and finalizers ---------------------------------------------
+ *
+ * a weak slot holds a ptr that marking doesn't follow. once marking is
+ * done, a slot that points at anything it didn't reach is cleared, and
+ * an object with a finalizer that it didn't reach has the finalizer
+ * queued. that is one pass over both tables, after marking and before
+ * sweeping, done a few entries at a time like everything else. nothing
+ * gets marked again: a finalizer is given what it was registered with,
+ * not the object, which is gone by the time it runs. what it is for is
+ * freeing whatever the object stood for outside the heap (a descriptor,
+ * a malloced buffer), which is what arg should be.
+ *
+ * finalizers run on a thread of their own, one queue's worth at a time,
+ * so they never hold up the collector. they can't touch the heap.
+ *
+ * between marking and sweeping, a slot not cleared yet may still point at
+ * an object that is about to go, so a weak slot has to be read with
+ * gc_weak_get. minor collections do the same for the young objects they
+ * free, all at once.
+ */
+
+typedef void (*finalize_fn)(void * arg);
+
+struct final {
+	struct obj * obj;
+	finalize_fn fn;
+	void * arg;
+};
+
+static struct obj *** weaks = 0;
+static size_t nweaks = 0, weaks_cap = 0;
+static struct final * finals = 0;
+static size_t nfinals = 0, finals_cap = 0;
+
+/* finalizers that are due, and the thread that runs them */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* broadcast on any change below */
+	struct final * queue;
+	size_t n, cap;
+	int busy;		/* running what it took off the queue */
+	int started;
+	pthread_t thread;
+} fin = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* register a slot holding a ptr to an object (or null) that shouldn't
+ * keep it alive. like a root, it has to stay put until it is removed. */
+void gc_add_weak(struct obj ** slot) {
+	pthread_mutex_lock( &roots_lock );
+	if (nweaks == weaks_cap) {
+		weaks_cap = weaks_cap ? 2 * weaks_cap : 64;
+		weaks = realloc( weaks, weaks_cap * sizeof(*weaks) );
+		if (!weaks)
+			die( 1, "weak table allocation failed" );
+	}
+	/* the finalizers are numbered after the slots. the new slot can
+	 * only point at something live, so the weak pass can skip it. */
+	if (gc.phase == GC_WEAK && gc.weak_cursor >= nweaks)
+		gc.weak_cursor++;
+	weaks[nweaks++] = slot;
+	pthread_mutex_unlock( &roots_lock );
+}
+
+void gc_remove_weak(struct obj ** slot) {
+	size_t i;
+	pthread_mutex_lock( &roots_lock );
+	for( i = 0; i < nweaks; i++ )
+		if (weaks[i] == slot) {
+			/* slots the weak pass has been past have to stay behind
+			 * its cursor, and the rest ahead of it */
+			if (gc.phase == GC_WEAK && gc.weak_cursor >= nweaks)
+				gc.weak_cursor--;
+			else if (gc.phase == GC_WEAK && i < gc.weak_cursor) {
+				weaks[i] = weaks[--gc.weak_cursor];
+				i = gc.weak_cursor;
+			}
+			weaks[i] = weaks[--nweaks];
+			break;
+		}
+	pthread_mutex_unlock( &roots_lock );
+}
+
+static void * fin_main(void * arg) {
+	(void) arg;
+	pthread_mutex_lock( &fin.lock );
+	for (;;) {
+		while (!fin.n)
+			pthread_cond_wait( &fin.cond, &fin.lock );
+
+		struct final * q = fin.queue;
+		size_t i, n = fin.n;
+		fin.queue = 0;
+		fin.n = fin.cap = 0;
+		fin.busy = 1;
+		pthread_mutex_unlock( &fin.lock );
+
+		for( i = 0; i < n; i++ )
+			q[i].fn(q[i].arg);
+		free( q );
+
+		pthread_mutex_lock( &fin.lock );
+		fin.busy = 0;
+		pthread_cond_broadcast( &fin.cond );
+	}
+	return 0;
+}
+
+/* call fn(arg) on the finalizer thread once o is found unreachable */
+void gc_finalize(struct obj * o, finalize_fn fn, void * arg) {
+	pthread_mutex_lock( &fin.lock );
+	if (!fin.started) {
+		if (pthread_create( &fin.thread, 0, fin_main, 0 ))
+			die( 1, "can't start the finalizer thread" );
+		fin.started = 1;
+	}
+	pthread_mutex_unlock( &fin.lock );
+
+	pthread_mutex_lock( &roots_lock );
+	if (nfinals == finals_cap) {
+		finals_cap = finals_cap ? 2 * finals_cap : 64;
+		finals = realloc( finals, finals_cap * sizeof(*finals) );
+		if (!finals)
+			die( 1, "finalizer table allocation failed" );
+	}
+	finals[nfinals++] = (struct final) { o, fn, arg };
+	pthread_mutex_unlock( &roots_lock );
+}
+
+/* wait for every finalizer queued so far to have run */
+void gc_finalize_wait(void) {
+	pthread_mutex_lock( &fin.lock );
+	while (fin.n || fin.busy)
+		pthread_cond_wait( &fin.cond, &fin.lock );
+	pthread_mutex_unlock( &fin.lock );
+}
+
+static void fin_queue(struct final f) {
+	pthread_mutex_lock( &fin.lock );
+	if (fin.n == fin.cap) {
+		fin.cap = fin.cap ? 2 * fin.cap : 64;
+		fin.queue = realloc( fin.queue, fin.cap * sizeof(*fin.queue) );
+		if (!fin.queue)
+			die( 1, "finalizer queue allocation failed" );
+	}
+	fin.queue[fin.n++] = f;
+	pthread_cond_broadcast( &fin.cond );
+	pthread_mutex_unlock( &fin.lock );
+}
+
+/* what a weak ptr to o should be once marking is done: o, or where it
+ * was evacuated to, or null */
+static inline struct obj * weak_target(struct obj * o) {
+	struct arena * a = get_arena(o);
+	if (!IS_MARKED(a, CELL_OF(a, o)))
+		return 0;
+	return a->c.evacuating ? ((struct obj **) o)[1] : o;
+}
+
+/* the same, once a minor collection has marked the nursery */
+static inline struct obj * weak_target_young(struct obj * o) {
+	struct arena * a = get_arena(o);
+	return a->c.young && !IS_OLD(a, CELL_OF(a, o)) ? 0 : o;
+}
+
+/* go through the weak slots and then the finalizers from *cursor on, for
+ * up to about budget entries. target is always a constant, so this gets
+ * inlined for each. a finalizer that is queued is swapped for the last,
+ * which has yet to be looked at. returns the work done. */
+static inline size_t weak_pass(size_t * cursor, size_t budget,
+		struct obj * (*target)(struct obj *)) {
+	size_t work = 0;
+	pthread_mutex_lock( &roots_lock );
+	while (work < budget && *cursor < nweaks + nfinals) {
+		work++;
+		if (*cursor < nweaks) {
+			struct obj ** slot = weaks[(*cursor)++];
+			if (*slot)
+				*slot = target(*slot);
+			continue;
+		}
+
+		struct final * f = &finals[*cursor - nweaks];
+		struct obj * o = target(f->obj);
+		if (o) {
+			f->obj = o;
+			++*cursor;
+		} else {
+			fin_queue(*f);
+			*f = finals[--nfinals];
+		}
+	}
+	pthread_mutex_unlock( &roots_lock );
+	return work;
+}
+
+/* read a weak slot, which is null once what it pointed at is unreachable */
+struct obj * gc_weak_get(struct obj ** slot) {
+	struct obj * o = *slot;
+	if (o && gc.phase == GC_WEAK)
+		*slot = o = weak_target(o);
+	return o;
+}
+
+/* starting the sweep is a unit of work too, so a small step that gets
+ * there stops there */
+static size_t step_weak(size_t budget) {
+	size_t work = weak_pass(&gc.weak_cursor, budget, weak_target);
+	if (work < budget && gc.weak_cursor >= nweaks + nfinals) {
+		if (gc.evac)
+			evac_release();
+		start_sweep();
+		work++;
+	}
+	return work;
+}
+
+/* evacuation -----------------------------------------------------------
+ *
+ * marking leaves sparse arenas behind: a few live cells keep a whole 64K
+ * block from ever being emptied and freed. a cycle run by gc_collect can
+ * instead copy everything live out of the arenas least full, and free
+ * them once marking is done. there is no read barrier, so this only
+ * happens with the mutator stopped for the whole cycle.
+ *
+ * an arena being emptied has no mark bits set when the cycle starts, so
+ * the mark bit on an object's first cell there means it has been moved,
+ * and the second word is the forwarding ptr. every ptr to it is reached
+ * by tracing (roots included), and is fixed up then. */
+
+/* how many cells are in use */
+static size_t arena_occupied(struct arena * a) {
+	size_t i, n = 0;
+	for( i = ARENA_HDR_UNITS / WORD_BITS; i < ARENA_WORDS; i++ )
+		n += __builtin_popcountl(a->used[i]);
+	return n;
+}
+
+static void visit_pin_arena(struct obj ** slot) {
+	get_arena(*slot)->c.evacuating = 0;
+}
+
+/* pick the arenas to empty. called with all marks clear. */
+static void evac_select(void) {
+	size_t limit = (ARENA_CELLS - ARENA_HDR_UNITS) * heap.evacuate / 100;
+	struct arena * a;
+	int n = 0;
+
+	for( a = heap.arenas; a; a = a->c.next )
+		if (a->c.kind == ARENA_SMALL && a != heap.current && !a->c.owned
+				&& arena_occupied(a) < limit)
+			a->c.evacuating = 1;
+
+	/* pinned objects stay put, and so does everything near them */
+	size_t i;
+	for( i = 0; i < npins; i++ )
+		if (pins[i].used && pins[i].obj)
+			get_arena(pins[i].obj)->c.evacuating = 0;
+	if (heap.conservative)
+		stack_scan(visit_pin_arena);
+
+	for( a = heap.arenas; a; a = a->c.next )
+		n += a->c.evacuating;
+
+	if (!n) {
+		gc.evac = 0;
+		return;
+	}
+
+	/* nothing can be allocated in them now, copies included */
+	struct arena ** link = &heap.free;
+	while ((a = *link)) {
+		if (a->c.evacuating) {
+			*link = a->c.freenext;
+			a->c.onfree = 0;
+		} else
+			link = &a->c.freenext;
+	}
+}
+
+/* move an object out of the arena it's in, if that hasn't been done
+ * already, and return where it is now. the copy is gray. */
+static struct obj * evacuate(struct arena * a, struct obj * o) {
+	size_t cell = CELL_OF(a, o);
+	struct obj ** fwd = (struct obj **) o + 1;
+	if (IS_MARKED(a, cell))
+		return *fwd;
+
+	size_t size = obj_units(&types[o->type], o) << UNIT_LOG2;
+	struct obj * to = heap_alloc_locked(o->type, size);
+	memcpy( to, o, size );
+
+	MARK(a, cell);
+	*fwd = to;
+
+	struct arena * ta = get_arena(to);
+	to->gray = 1;
+	gs_push(ta, to);
+	return to;
+}
+
+static void visit_evac(struct obj ** slot) {
+	struct obj * o = *slot;
+	if (!o)
+		return;
+
+	struct arena * a = get_arena(o);
+	if (a->c.evacuating)
+		*slot = evacuate(a, o);
+	else
+		shade(o);
+}
+
+/* take the arenas pick picks off the lists they are on, and free them.
+ * none of them can be on a free list, or gray. */
+static void arenas_release(int (*pick)(struct arena * a)) {
+	struct arena ** link, * a;
+
+	for( link = &heap.nursery; (a = *link); )
+		if (pick(a)) {
+			*link = a->c.nursenext;
+			heap.nyoung--;
+		} else
+			link = &a->c.nursenext;
+
+	for( link = &heap.dirty; (a = *link); )
+		if (pick(a))
+			*link = a->c.dirtynext;
+		else
+			link = &a->c.dirtynext;
+
+	for( link = &heap.arenas; (a = *link); )
+		if (pick(a)) {
+			if (gc.sweep_cursor == a)
+				gc.sweep_cursor = a->c.next;
+			*link = a->c.next;
+			arena_free(a);
+		} else
+			link = &a->c.next;
+}
+
+static int arena_evacuating(struct arena * a) {
+	return a->c.evacuating;
+}
+
+/* marking is done, so nothing points into the emptied arenas any more */
+static void evac_release(void) {
+	arenas_release(arena_evacuating);
+	gc.evac = 0;
+}
+
+/* scavenging ------------------------------------------------------------
+ *
+ * an arena that sweeping finds empty goes back on a free list, and stays
+ * there however long it goes unused, so after a spike the heap never
+ * gets any smaller. the scavenger frees the empty arenas on the free
+ * lists, bar the first heap.scavenge_keep, and the gs chunks spare in
+ * the pool and this thread's cache. region arenas go back to the region,
+ * pages dropped, as usual.
+ *
+ * it runs every heap.scavenge_ms, from gc_step while the heap is idle or
+ * from the collector thread between cycles, and whenever gc_scavenge
+ * asks. gc_memory_pressure asks for more: nothing kept, the region's
+ * spares dropped with MADV_DONTNEED (pages given MADV_FREE still count
+ * against a memory limit until the kernel gets round to them), and the
+ * system allocator trimmed. with the collector thread and no
+ * heap.scavenge_ms, it waits for the end of the next cycle.
+ */
+
+static struct {
+	unsigned long long next;	/* ms when the next timed one is due */
+	int asked;		/* by gc_scavenge, when it couldn't be done */
+	int pressure;		/* by gc_memory_pressure */
+} scav;
+
+static unsigned long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+#if GC_STATS
+/* resident bytes, or 0 if that can't be found out */
+static size_t rss_bytes(void) {
+	size_t pages = 0;
+	FILE * f = fopen( "/proc/self/statm", "r" );
+	if (f) {
+		if (fscanf( f, "%*s %zu", &pages ) != 1)
+			pages = 0;
+		fclose( f );
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+static inline int scavenge_due(void) {
+	return __atomic_load_n( &scav.pressure, __ATOMIC_RELAXED )
+		|| __atomic_load_n( &scav.asked, __ATOMIC_RELAXED )
+		|| (heap.scavenge_ms && now_ms() >= scav.next);
+}
+
+static int arena_scavenged(struct arena * a) {
+	return a->c.scavenged;
+}
+
+/* take the empty arenas off a free list, once *keep of them are kept */
+static size_t scavenge_list(struct arena ** link, int * keep) {
+	struct arena * a;
+	size_t n = 0;
+	while ((a = *link)) {
+		if (arena_occupied(a) || (*keep)-- > 0) {
+			link = &a->c.freenext;
+			continue;
+		}
+		*link = a->c.freenext;
+		a->c.onfree = 0;
+		a->c.scavenged = 1;
+		n++;
+	}
+	return n;
+}
+
+/* give back what the heap isn't using. the heap has to be idle, and in
+ * concurrent mode heap_lock held. returns the bytes freed. */
+static size_t scavenge(void) {
+	int pressure = __atomic_exchange_n( &scav.pressure, 0, __ATOMIC_RELAXED );
+	__atomic_store_n( &scav.asked, 0, __ATOMIC_RELAXED );
+	scav.next = now_ms() + (unsigned) heap.scavenge_ms;
+	SPAN_START(t0);
+	STAT(stats.cur.rss_before = rss_bytes());
+
+	int keep = pressure ? 0 : heap.scavenge_keep, t;
+	size_t n = scavenge_list(&heap.free, &keep);
+	for( t = 0; t < NUM_TYPES; t++ )
+		n += scavenge_list(&heap.tiny[t].free, &keep);
+	if (n)
+		arenas_release(arena_scavenged);
+
+	gs_cache_flush();
+	size_t bytes = n * ARENA_SIZE + (size_t) gs_trim(0) * sizeof(struct gs);
+
+	if (pressure) {
+		size_t i;
+		for( i = 0; i < region.nspare; i++ )
+			madvise( region.spare[i], ARENA_SIZE, MADV_DONTNEED );
+#ifdef __GLIBC__
+		malloc_trim( 0 );
+#endif
+	}
+
+	STAT_ADD(scavenged_bytes, bytes);
+	STAT(stats.cur.rss_after = rss_bytes());
+	SPAN_END(t0, SPAN_SCAVENGE);
+	return bytes;
+}
+
+static void conc_scavenge(void);
+
+/* give memory back now if the heap is idle, or as soon as it is */
+void gc_scavenge(void) {
+	if (heap.concurrent)
+		conc_scavenge();
+	else if (gc.phase == GC_IDLE)
+		scavenge();
+	else
+		__atomic_store_n( &scav.asked, 1, __ATOMIC_RELAXED );
+}
+
+/* memory is short: scavenge, keeping nothing, at the next chance. only
+ * sets a flag, so it can be called from a signal handler. */
+void gc_memory_pressure(void) {
+	__atomic_store_n( &scav.pressure, 1, __ATOMIC_RELAXED );
+}
+
+/* pacing ---------------------------------------------------------------
+ *
+ * with heap.gc_percent set, gc_step leaves the heap alone until enough
+ * has been allocated since the last cycle finished marking, like GOGC:
+ * marking should be done by the time the heap is that percent bigger
+ * than what the last cycle found live. the cycle starts some way short
+ * of that goal, and how far short is adjusted by how close the last one
+ * came.
+ *
+ * while a cycle runs, allocation runs up a debt, in proportion to the
+ * work left over the room left before the goal, where the work left goes
+ * by how much the last cycle took, with some to spare. past the goal,
+ * the proportion keeps growing until the cycle is done. every so often,
+ * and at each gc_step, a thread pays off its debt with collector work.
+ * anything it does beyond that is credit against what it allocates next,
+ * until marking is done. so a thread which allocates a lot can't outrun
+ * the collector, and one which calls gc_step often does it all there.
+ * it also means allocation can collect, as with a generational heap, so
+ * objects only the C stack knows about had better be in a frame.
+ */
+
+#define PACE_MIN_LIVE (4 * ARENA_SIZE)	/* below this, pace as if it were */
+#define PACE_RATIO (0.7)	/* to start with */
+#define PACE_RATIO_MIN (0.3)
+#define PACE_RATIO_MAX (0.95)
+#define PACE_ADJUST (0.1)
+#define PACE_MIN_RUNWAY (64 << 10)
+#define ASSIST_BYTES (4096)	/* of debt run up before an assist */
+
+static __thread struct {
+	size_t bytes;		/* allocated since the last payment */
+	size_t credit;		/* work done beyond what was owed */
+	unsigned epoch;		/* the credit is for */
+} assist;
+
+/* marking is done, so how much is live is known: set up the next cycle */
+static void pace_marked(void) {
+	if (!gc.ratio || !heap.gc_percent)
+		gc.ratio = PACE_RATIO;
+	else if (gc.allocated > gc.goal)
+		gc.ratio -= PACE_ADJUST;
+	else if (gc.allocated < gc.trigger + (gc.goal - gc.trigger) / 2)
+		gc.ratio += PACE_ADJUST / 2;
+	if (gc.ratio < PACE_RATIO_MIN)
+		gc.ratio = PACE_RATIO_MIN;
+	if (gc.ratio > PACE_RATIO_MAX)
+		gc.ratio = PACE_RATIO_MAX;
+
+	size_t live = gc.marked_bytes > PACE_MIN_LIVE ? gc.marked_bytes : PACE_MIN_LIVE;
+	size_t grow = live / 100 * (size_t) heap.gc_percent;
+	gc.goal = gc.allocated + grow;
+	gc.trigger = gc.allocated + (size_t) (grow * gc.ratio);
+}
+
+static void pace_start(void) {
+	if (gc.work)
+		gc.last_work = gc.work;
+	gc.work = 0;
+}
+
+/* work owed per byte allocated, to stay ahead of allocation */
+static double pace_ratio(void) {
+	size_t expect = gc.last_work + gc.last_work / 2;
+	size_t left = expect > gc.work ? expect - gc.work : gc.last_work / 4;
+	double runway = PACE_MIN_RUNWAY;
+	if (gc.goal > gc.allocated + PACE_MIN_RUNWAY)
+		runway = gc.goal - gc.allocated;
+	else if (gc.allocated > gc.goal)
+		/* past it, the runway shrinks the further past it gets */
+		runway /= 1.0 + (double) (gc.allocated - gc.goal) / PACE_MIN_RUNWAY;
+	return left / runway;
+}
+
+static size_t collect_step(size_t budget);
+
+/* do what this thread owes, or budget if that's more */
+static size_t assist_pay(size_t budget) {
+	if (assist.epoch != gc.epoch) {
+		assist.epoch = gc.epoch;
+		assist.credit = 0;
+	}
+	size_t owed = (size_t) (pace_ratio() * assist.bytes);
+	assist.bytes = 0;
+	if (owed <= assist.credit) {
+		assist.credit -= owed;
+		owed = 0;
+	} else {
+		owed -= assist.credit;
+		assist.credit = 0;
+	}
+
+	/* always some, or a cycle that the last one says is next to no
+	 * work, like one with nothing live, is never finished */
+	size_t want = owed > budget ? owed : budget;
+	size_t work = collect_step(want ? want : 1);
+	if (work > owed)
+		assist.credit += work - owed;
+	return work;
+}
+
+/* the allocator is about to allocate objsize bytes. while the heap is
+ * idle, that only matters if it's time to start a cycle. */
+static void assist_alloc(size_t objsize) {
+	if (gc.stepping)
+		return;
+	if (gc.phase == GC_IDLE) {
+		if (gc.allocated >= gc.trigger)
+			collect_step(0);
+		return;
+	}
+	assist.bytes += objsize;
+	if (assist.bytes >= ASSIST_BYTES)
+		assist_pay(0);
+}
+
+/* gc_step, without the pacing */
+static size_t collect_step(size_t budget) {
+	size_t work = 0;
+
+	/* the collector thread does it all */
+	if (heap.concurrent)
+		return 0;
+	SPAN_START(t0);
+	gc.stepping = 1;
+
+	if (gc.phase == GC_IDLE && gc.sweep_cursor) {
+		/* whatever lazy sweeping didn't get to has to be done before
+		 * marking can start again */
+		gc.lazy = 0;
+		gc.phase = GC_SWEEP;
+	} else if (gc.phase == GC_IDLE) {
+		start_marks();
+		pace_start();
+		if (gc.evac)
+			evac_select();
+		gc.phase = GC_ROOTS;
+		gc.root_cursor = 0;
+	}
+
+	while (work < budget && gc.phase != GC_IDLE) {
+		switch (gc.phase) {
+		case GC_ROOTS: TIMED(SPAN_ROOTS, work += step_roots(budget - work)); break;
+		case GC_MARK: TIMED(SPAN_MARK, work += step_mark(budget - work)); break;
+		case GC_WEAK: TIMED(SPAN_WEAK, work += step_weak(budget - work)); break;
+		case GC_SWEEP: TIMED(SPAN_SWEEP, work += step_sweep(budget - work)); break;
+		case GC_IDLE: break;
+		}
+	}
+
+	gc.stepping = 0;
+	PAUSE_END(t0);
+	gc.work += work;
+	return work;
+}
+
+/* do up to about budget units of collector work, where a unit is one root
+ * or object marked, and a swept arena is SWEEP_WORK units. starts a new
+ * cycle if none is running (first finishing any sweeping left over from
+ * the last one), unless it's paced and not due yet, and returns early
+ * when a cycle completes. paced, it may do more than budget. returns the
+ * work actually done. with the heap idle, scavenges first if that's due. */
+size_t gc_step(size_t budget) {
+	if (!heap.concurrent && gc.phase == GC_IDLE && scavenge_due())
+		scavenge();
+	if (heap.gc_percent && !heap.concurrent) {
+		if (gc.phase == GC_IDLE && gc.allocated < gc.trigger)
+			return 0;
+		return assist_pay(budget);
+	}
+	return collect_step(budget);
+}
+
+static void conc_collect(void);
+
+/* finish any cycle in progress, then run a whole one */
+void gc_collect(void) {
+	if (heap.concurrent) {
+		conc_collect();
+		return;
+	}
+
+	while (gc.phase != GC_IDLE)
+		collect_step(GC_UNBOUNDED);
+
+	/* nothing else runs until this returns, so it is the one place it's
+	 * safe to move objects */
+	gc.evac = heap.evacuate > 0;
+
+	unsigned epoch = gc.epoch;
+	while (gc.epoch == epoch || gc.phase != GC_IDLE)
+		collect_step(GC_UNBOUNDED);
+}
+
+/* generational collection ----------------------------------------------- */
+
+/* shade for a minor collection, where everything old counts as black */
+static inline void shade_young(struct obj * o) {
+	if (!o) return;
+	struct arena * a = get_arena(o);
+	if (a->c.kind == ARENA_LARGE || IS_OLD(a, CELL_OF(a, o)) || is_gray(a, o)) return;
+	set_gray(a, o, 1);
+	gs_push(a, o);
+}
+
+static void visit_shade_young(struct obj ** slot) {
+	shade_young(*slot);
+}
+
+/* mark and promote the next young object on an arena's gs */
+static int mark_young(struct arena * a) {
+	struct obj * o = gs_pop(a);
+	if (!o) return 0;
+
+	struct type * t = type_of(a, o);
+	size_t c = CELL_OF(a, o);
+	mark_cells(a, c, obj_units(t, o));
+	SET_OLD(a, c);
+	set_gray(a, o, 0);
+	STAT(stats.cur.marked++; stats.cur.marked_bytes += (size_t) obj_units(t, o) << UNIT_LOG2);
+
+	trace(t, o, visit_shade_young);
+	return 1;
+}
+
+/* the last old object to start at or before cell c, or 0 */
+static size_t old_before(struct arena * a, size_t c) {
+	size_t i = c / WORD_BITS;
+	word_t w = a->old[i] & (BIT(c) | (BIT(c) - 1));
+	while (!w && i > ARENA_HDR_UNITS / WORD_BITS)
+		w = a->old[--i];
+	return w ? i * WORD_BITS + (WORD_BITS - 1 - __builtin_clzl(w)) : 0;
+}
+
+/* shade whatever the old objects on an arena's dirty cards point at, and
+ * clean them. the first object found may start on an earlier card. */
+static void scan_cards(struct arena * a) {
+	if (a->c.kind == ARENA_LARGE) {
+		struct obj * o = (struct obj *)((size_t)a + ARENA_HDR_UNITS * ALLOC_UNIT);
+		trace(&types[o->type], o, visit_shade_young);
+		return;
+	}
+
+	size_t k;
+	for( k = 0; k < sizeof(a->c.cards); k++ ) {
+		if (!a->c.cards[k])
+			continue;
+		a->c.cards[k] = 0;
+
+		size_t c = k * CARD_CELLS, end = c + CARD_CELLS;
+		size_t s = old_before(a, c);
+		if (!s)
+			s = c;
+		while (s < end) {
+			struct obj * o = (struct obj *)((size_t)a + s * ALLOC_UNIT);
+			struct type * t = type_of(a, o);
+			if (IS_OLD(a, s) && s + obj_units(t, o) > c)
+				trace(t, o, visit_shade_young);
+
+			/* on to the next start in the card */
+			size_t i = ++s / WORD_BITS;
+			word_t w = i < ARENA_WORDS ? a->old[i] & ~(BIT(s) - 1) : 0;
+			while (!w && ++i < ARENA_WORDS && i * WORD_BITS < end)
+				w = a->old[i];
+			if (!w)
+				break;
+			s = i * WORD_BITS + __builtin_ctzl(w);
+		}
+	}
+}
+
+/* collect just the nursery, with the mutator stopped: mark the young
+ * objects reachable from the roots and the dirty cards, promoting them as
+ * they go, then sweep the nursery arenas. does nothing while a major
+ * collection is marking; any sweeping left over from one is finished
+ * first. */
+void gc_minor(void) {
+	if (!generational() || (gc.phase != GC_IDLE && gc.phase != GC_SWEEP))
+		return;
+	SPAN_START(t0);
+
+	sweep_all();
+
+	if (heap.current)
+		nursery_add(heap.current);
+
+	roots_visit(visit_shade_young);
+
+	while (heap.dirty) {
+		struct arena * a = heap.dirty;
+		heap.dirty = a->c.dirtynext;
+		a->c.dirty = 0;
+		scan_cards(a);
+	}
+
+	while (gc.gray) {
+		struct arena * a = gc.gray;
+		if (!mark_young(a)) {
+			gc.gray = a->b.graynext;
+			a->b.ongray = 0;
+		}
+	}
+	size_t weak_cursor = 0;
+	weak_pass(&weak_cursor, GC_UNBOUNDED, weak_target_young);
+
+	/* nothing young is left, so the nursery starts again empty */
+	while (heap.nursery) {
+		struct arena * a = heap.nursery;
+		heap.nursery = a->c.nursenext;
+		a->c.young = 0;
+		sweep(a);
+	}
+	heap.nyoung = 0;
+	if (heap.current)
+		nursery_add(heap.current);
+	int i;
+	for( i = 0; i < NUM_TYPES; i++ )
+		if (heap.tiny[i].current)
+			nursery_add(heap.tiny[i].current);
+
+	gc.minors++;
+	STAT_ADD(minors, 1);
+	SPAN_END(t0, SPAN_MINOR);
+	PAUSE_END(t0);
+}
+
+/* concurrent marking -----------------------------------------------------
+ *
+ * after gc_concurrent_start, a collector thread runs whole cycles while
+ * the mutator threads carry on. a mutator thread has to be attached, has
+ * to call gc_safepoint now and then, and at a safepoint can't be holding
+ * ptrs that are only in its locals.
+ *
+ * each attached thread allocates from an arena of its own (its tlab),
+ * which nobody else allocates from or sweeps, so small objects are had
+ * without any locking. only swapping a full tlab for another takes
+ * heap_lock, which is also what the collector sweeps the other arenas
+ * under, a few at a time. a tlab is swept by its owner when it is next
+ * allocated from after a cycle, or by the collector with the mutators
+ * stopped when the next one starts.
+ *
+ * marking is done by the parallel marker, whose atomics already cope with
+ * other threads shading and marking the same objects. the barrier can't
+ * use the arenas' gray stacks, which belong to the collector, so each
+ * mutator fills a chunk of its own and hands it over when it is full.
+ * the mutators are only stopped twice a cycle: to turn marking on, and to
+ * remark, which takes the chunks they had part filled, shades the roots
+ * once more, and finishes the (usually small) marking that turns up.
+ */
+
+/* arenas swept per hold of heap_lock */
+#define CONC_SWEEP_BUDGET (8 * SWEEP_WORK)
+
+/* concurrent passes over the roots and the barrier's chunks before the
+ * remark, which does the rest with the mutators stopped */
+#define CONC_ROUNDS (4)
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* broadcast on any change below */
+	int stop;		/* mutators should park */
+	int nthreads;		/* attached mutators */
+	int parked;
+	int marking;		/* the barrier is on. only changes while the
+				 * mutators are stopped */
+	int requested;		/* someone wants a cycle */
+	int running;		/* the collector is in one */
+	int quit;
+	unsigned cycles;	/* done */
+	struct gs * barrier;	/* chunks the mutators have handed over */
+	struct mutator * mutators;
+	pthread_t thread;
+} conc = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+struct mutator {
+	int attached;
+	struct gs * gs;		/* the chunk this thread's barrier fills */
+	struct arena * tlab;	/* the arena it allocates from */
+	struct gc_frame ** frames;	/* its shadow stack */
+	ucontext_t regs;	/* with conservative scanning, where it was */
+	char * sp;		/* when it parked */
+	char * stack_hi;
+	struct mutator * next;	/* all attached mutators */
+};
+
+/* a parked mutator leaves its registers and the bottom of its stack where
+ * the collector can scan them */
+#define MUT_SAVE_STACK() do {\
+		if (heap.conservative)\
+			mut_save_stack();\
+	} while(0)
+
+static __thread struct mutator mut;
+
+/* getcontext, as it saves the registers as they are, and the bottom is a
+ * local here, below every frame of the callers, and any registers they
+ * spilled */
+static void __attribute__((noinline)) mut_save_stack(void) {
+	char here = 0;
+	getcontext( &mut.regs );
+	mut.sp = &here;
+}
+
+/* the collector only ever takes the whole list, so there is no ABA
+ * problem in pushing onto it */
+static void conc_hand_over(struct gs * gs) {
+	struct gs * head = __atomic_load_n( &conc.barrier, __ATOMIC_RELAXED );
+	do
+		gs->prev = head;
+	while (!__atomic_compare_exchange_n( &conc.barrier, &head, gs, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED ));
+}
+
+static void mut_flush(void) {
+	STAT(barrier_stats_flush());
+	if (mut.gs && mut.gs->n)
+		conc_hand_over(mut.gs);
+	else if (mut.gs)
+		gs_put(mut.gs);
+	mut.gs = 0;
+}
+
+/* the serial barrier's test, but the gray and mark bits have to be read
+ * after the store the barrier follows is visible to the collector, or it
+ * could trace the object between the two and miss the store. */
+static void conc_barrier(struct obj * o) {
+	if (!conc.marking) return;
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	STAT(barrier_stats.calls++);
+
+	struct arena * a = get_arena(o);
+	if (!is_marked_atomic(a, CELL_OF(a, o)) || obj_gray_atomic(a, o))
+		return;
+	STAT(barrier_stats.pushes++);
+
+	if (mut.gs && mut.gs->n == GS_SIZE) {
+		conc_hand_over(mut.gs);
+		mut.gs = 0;
+	}
+	if (!mut.gs) {
+		mut.gs = gs_get();
+		mut.gs->n = 0;
+	}
+	mut.gs->data[ GS_SIZE - ++mut.gs->n ] = o;
+}
+
+/* with conc.lock held. a parked thread's chunk is handed over first, so
+ * the remark sees everything its barrier has done. */
+static void conc_park(void) {
+	MUT_SAVE_STACK();
+	mut_flush();
+	conc.parked++;
+	pthread_cond_broadcast( &conc.cond );
+	while (conc.stop)
+		pthread_cond_wait( &conc.cond, &conc.lock );
+	conc.parked--;
+}
+
+void gc_safepoint(void) {
+	if (!__atomic_load_n( &conc.stop, __ATOMIC_ACQUIRE ))
+		return;
+
+	pthread_mutex_lock( &conc.lock );
+	conc_park();
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* ask for a cycle, without waiting for it */
+static void conc_kick(void) {
+	pthread_mutex_lock( &conc.lock );
+	if (!conc.requested) {
+		conc.requested = 1;
+		pthread_cond_broadcast( &conc.cond );
+	}
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* with heap_lock held. a tlab can only be behind on sweeping between a
+ * remark and the next cycle, so sweeping it here can't race marking. */
+static void tlab_release(struct arena * a) {
+	a->c.owned = 0;
+	if (a->c.swept != gc.epoch)
+		sweep(a);
+}
+
+/* with heap_lock held */
+static struct obj * tlab_alloc(int type, size_t objsize) {
+	struct arena * a = mut.tlab;
+	struct obj * o = a ? arena_alloc(a, objsize) : 0;
+
+	while (!o) {
+		if (a)
+			tlab_release(a);
+		a = mut.tlab = heap_take_arena();
+		a->c.owned = 1;
+		o = arena_alloc(a, objsize);
+	}
+
+	o->type = type;
+	return o;
+}
+
+/* heap_alloc in concurrent mode. the tlab is only used without the lock
+ * once it is swept, since sweeping one can put it on the free list. a
+ * heap that had to grow asks the collector for a cycle. */
+static struct obj * conc_alloc(int type, size_t objsize) {
+	struct arena * a = mut.tlab;
+	struct obj * o;
+
+	/* tiny objects come from their own arenas, so always take the lock */
+	int small = objsize <= ARENA_MAX_OBJ && !types[type].tiny;
+	if (a && a->c.swept == gc.epoch && small && (o = arena_alloc(a, objsize))) {
+		o->type = type;
+		return o;
+	}
+
+	pthread_mutex_lock( &heap_lock );
+	size_t narenas = heap.narenas, nlarge = heap.nlarge;
+	if (mut.attached && small)
+		o = tlab_alloc(type, objsize);
+	else
+		o = heap_alloc_locked(type, objsize);
+	int grew = heap.narenas > narenas || heap.nlarge > nlarge;
+	pthread_mutex_unlock( &heap_lock );
+
+	if (grew)
+		conc_kick();
+	return o;
+}
+
+void gc_thread_attach(void) {
+	pthread_mutex_lock( &conc.lock );
+	while (conc.stop)
+		pthread_cond_wait( &conc.cond, &conc.lock );
+	conc.nthreads++;
+	mut.attached = 1;
+	mut.frames = &gc_frames;
+	mut.stack_hi = stack_base();
+	mut.next = conc.mutators;
+	conc.mutators = &mut;
+	pthread_mutex_unlock( &conc.lock );
+}
+
+void gc_thread_detach(void) {
+	pthread_mutex_lock( &heap_lock );
+	if (mut.tlab)
+		tlab_release(mut.tlab);
+	mut.tlab = 0;
+	pthread_mutex_unlock( &heap_lock );
+
+	pthread_mutex_lock( &conc.lock );
+	if (conc.stop)
+		conc_park();
+	mut_flush();
+	gs_cache_flush();
+
+	struct mutator ** link = &conc.mutators;
+	while (*link != &mut)
+		link = &(*link)->next;
+	*link = mut.next;
+
+	conc.nthreads--;
+	mut.attached = 0;
+	pthread_cond_broadcast( &conc.cond );
+	pthread_mutex_unlock( &conc.lock );
+}
+
+static void conc_stop_world(void) {
+	pthread_mutex_lock( &conc.lock );
+	__atomic_store_n( &conc.stop, 1, __ATOMIC_RELEASE );
+	while (conc.parked < conc.nthreads)
+		pthread_cond_wait( &conc.cond, &conc.lock );
+	pthread_mutex_unlock( &conc.lock );
+}
+
+static void conc_start_world(void) {
+	pthread_mutex_lock( &conc.lock );
+	__atomic_store_n( &conc.stop, 0, __ATOMIC_RELEASE );
+	pthread_cond_broadcast( &conc.cond );
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* shade onto a list of chunks, where the barrier's chunks go too */
+static void conc_shade(struct gs ** list, struct obj * o) {
+	if (!o) return;
+	struct arena * a = get_arena(o);
+	if (is_marked_atomic(a, CELL_OF(a, o)) || obj_gray_atomic(a, o))
+		return;
+
+	struct gs * gs = *list;
+	if (!gs || gs->n == GS_SIZE) {
+		gs = gs_get();
+		gs->n = 0;
+		gs->prev = *list;
+		*list = gs;
+	}
+	gs->data[ GS_SIZE - ++gs->n ] = o;
+}
+
+static struct gs ** gather_list;
+
+static void visit_conc_shade(struct obj ** slot) {
+	conc_shade(gather_list, *slot);
+}
+
+/* all the gray objects there are: the barrier's, and any roots not yet
+ * marked. null if marking is done, as far as the mutators have told us.
+ * the mutators' frames can only be looked at while they are stopped. */
+static struct gs * conc_gather(int stopped) {
+	struct gs * list = __atomic_exchange_n( &conc.barrier, 0, __ATOMIC_ACQUIRE );
+
+	size_t i;
+	pthread_mutex_lock( &roots_lock );
+	for( i = 0; i < nroot_slots(); i++ ) {
+		struct obj ** slot = root_slot(i);
+		if (slot)
+			conc_shade( &list, __atomic_load_n( slot, __ATOMIC_RELAXED ) );
+	}
+	pthread_mutex_unlock( &roots_lock );
+
+	struct mutator * m;
+	struct gc_frame * f;
+	int j;
+	for( m = conc.mutators; m && stopped; m = m->next ) {
+		for( f = *m->frames; f; f = f->prev )
+			for( j = 0; j < f->n; j++ )
+				conc_shade( &list, *f->slots[j] );
+
+		if (heap.conservative && m->sp) {
+			gather_list = &list;
+			conservative_range( &m->regs, &m->regs + 1, visit_conc_shade );
+			conservative_range( m->sp, m->stack_hi, visit_conc_shade );
+		}
+	}
+
+	return list;
+}
+
+/* sweep whatever is left to sweep, including anything lazy sweeping
+ * didn't get to last cycle */
+static void conc_sweep(void) {
+	int done;
+	do {
+		pthread_mutex_lock( &heap_lock );
+		if (gc.phase == GC_IDLE && gc.sweep_cursor) {
+			gc.lazy = 0;
+			gc.phase = GC_SWEEP;
+		}
+		if (gc.phase == GC_SWEEP)
+			step_sweep(CONC_SWEEP_BUDGET);
+		done = gc.phase == GC_IDLE;
+		pthread_mutex_unlock( &heap_lock );
+	} while (!done);
+}
+
+static void conc_cycle(void) {
+	int threads = heap.mark_threads > 1 ? heap.mark_threads : 1;
+	struct gs * list;
+	int i;
+
+	TIMED(SPAN_CONC_SWEEP, conc_sweep());
+
+	/* phase only changes with the mutators stopped, or under heap_lock
+	 * (which is what allocation reads it under) */
+	SPAN_START(t0);
+	conc_stop_world();
+
+	/* tlabs which haven't been allocated from since the last cycle are
+	 * the only arenas still unswept */
+	struct mutator * m;
+	pthread_mutex_lock( &heap_lock );
+	for( m = conc.mutators; m; m = m->next )
+		if (m->tlab && m->tlab->c.swept != gc.epoch)
+			sweep(m->tlab);
+	pthread_mutex_unlock( &heap_lock );
+	start_marks();
+
+	gc.phase = GC_MARK;
+	conc.marking = 1;
+	conc_start_world();
+	SPAN_END(t0, SPAN_STOPPED);
+	PAUSE_END(t0);
+
+	SPAN_START(t1);
+	for( i = 0; i < CONC_ROUNDS && (list = conc_gather(0)); i++ )
+		mark_parallel(threads, list);
+	SPAN_END(t1, SPAN_CONC_MARK);
+
+	SPAN_START(t2);
+	conc_stop_world();
+	while ((list = conc_gather(1)))
+		mark_parallel(threads, list);
+	conc.marking = 0;
+	gc.phase = GC_WEAK;
+	gc.weak_cursor = 0;
+	step_weak(GC_UNBOUNDED);
+	conc_start_world();
+	SPAN_END(t2, SPAN_STOPPED);
+	PAUSE_END(t2);
+
+	TIMED(SPAN_CONC_SWEEP, conc_sweep());
+}
+
+/* wait on conc.cond until the next timed scavenge is due */
+static void conc_wait_scavenge(void) {
+	unsigned long long now = now_ms(), ms = scav.next > now ? scav.next - now : 0;
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait( &conc.cond, &conc.lock, &ts );
+}
+
+static void * conc_main(void * arg) {
+	(void) arg;
+	pthread_mutex_lock( &conc.lock );
+	for (;;) {
+		/* between cycles the heap is idle, and the collector's to
+		 * scavenge */
+		while (!conc.requested && !conc.quit) {
+			if (scavenge_due()) {
+				pthread_mutex_unlock( &conc.lock );
+				pthread_mutex_lock( &heap_lock );
+				scavenge();
+				pthread_mutex_unlock( &heap_lock );
+				pthread_mutex_lock( &conc.lock );
+			} else if (heap.scavenge_ms)
+				conc_wait_scavenge();
+			else
+				pthread_cond_wait( &conc.cond, &conc.lock );
+		}
+		if (conc.quit)
+			break;
+
+		conc.requested = 0;
+		conc.running = 1;
+		pthread_mutex_unlock( &conc.lock );
+
+		conc_cycle();
+
+		pthread_mutex_lock( &conc.lock );
+		conc.running = 0;
+		conc.cycles++;
+		pthread_cond_broadcast( &conc.cond );
+	}
+	pthread_mutex_unlock( &conc.lock );
+
+	/* its cached chunks would go with the thread */
+	gs_cache_flush();
+	return 0;
+}
+
+/* gc_collect in concurrent mode: wait for a whole cycle started after
+ * now. an attached thread counts as parked while it waits. */
+static void conc_collect(void) {
+	pthread_mutex_lock( &conc.lock );
+	unsigned target = conc.cycles + 1 + conc.running;
+	conc.requested = 1;
+	pthread_cond_broadcast( &conc.cond );
+
+	if (mut.attached) {
+		MUT_SAVE_STACK();
+		mut_flush();
+		conc.parked++;
+		pthread_cond_broadcast( &conc.cond );
+	}
+	while ((int)(conc.cycles - target) < 0 || (mut.attached && conc.stop))
+		pthread_cond_wait( &conc.cond, &conc.lock );
+	if (mut.attached)
+		conc.parked--;
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* gc_scavenge in concurrent mode: wake the collector to do it */
+static void conc_scavenge(void) {
+	pthread_mutex_lock( &conc.lock );
+	__atomic_store_n( &scav.asked, 1, __ATOMIC_RELAXED );
+	pthread_cond_broadcast( &conc.cond );
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* hand collection over to a collector thread. any cycle the caller had
+ * going is finished first. */
+void gc_concurrent_start(void) {
+	if (heap.concurrent)
+		return;
+	while (gc.phase != GC_IDLE)
+		collect_step(GC_UNBOUNDED);
+
+	heap.concurrent = 1;
+	if (pthread_create( &conc.thread, 0, conc_main, 0 ))
+		die( 1, "failed to start collector thread" );
+}
+
+/* stop the collector thread once it finishes the cycle it is on, if any.
+ * after this, collection is back to gc_step, and threads still attached
+ * give up their tlabs, which serial sweeping would pass over. */
+void gc_concurrent_stop(void) {
+	if (!heap.concurrent)
+		return;
+
+	pthread_mutex_lock( &conc.lock );
+	conc.quit = 1;
+	if (mut.attached) {
+		MUT_SAVE_STACK();
+		mut_flush();
+		conc.parked++;
+	}
+	pthread_cond_broadcast( &conc.cond );
+	pthread_mutex_unlock( &conc.lock );
+
+	pthread_join( conc.thread, 0 );
+
+	pthread_mutex_lock( &conc.lock );
+	if (mut.attached)
+		conc.parked--;
+	conc.quit = 0;
+	conc.requested = 0;
+
+	struct mutator * m;
+	pthread_mutex_lock( &heap_lock );
+	heap.concurrent = 0;
+	for( m = conc.mutators; m; m = m->next ) {
+		if (m->tlab)
+			tlab_release(m->tlab);
+		m->tlab = 0;
+	}
+	pthread_mutex_unlock( &heap_lock );
+	pthread_mutex_unlock( &conc.lock );
+}
+
+/* heap snapshots ---------------------------------------------------------
+ *
+ * an arena is self-describing: its used and start bits say which cells
+ * are objects, and the objects say what they are, so everything else in
+ * the header can be worked out again. so the heap can be written out as it stands,
+ * an arena at a time, and mapped back in by a later run of the same
+ * program, with the same types registered, instead of being built all
+ * over again. gc_snapshot_write collects first, so only what is live
+ * goes. gc_snapshot_map maps each arena straight from the file, copy on
+ * write, at the address it was written from if that is free. then only
+ * its header is touched (and with a nursery, every object's, to make it
+ * old), and the objects are read in as they are used.
+ * if any arena has to go somewhere else, every ptr in every object is
+ * fixed up by looking up which arena it was into, which reads (and
+ * copies) the whole image.
+ *
+ * a snapshot's objects count as just allocated, and after that are like
+ * any others, but a mapped arena is unmapped when it is freed.
+ */
+
+#define SNAPSHOT_MAGIC "incgc-1"
+
+struct snapshot_hdr {
+	char magic[8];
+	int arena_log2, unit_log2;
+	int units[NUM_TYPES];	/* of each type, which have to match */
+	unsigned char tiny[NUM_TYPES];
+	size_t n;		/* arenas, large objects included */
+	struct obj * root;
+};
+
+/* the table of arenas follows the header, sorted by where they were, and
+ * the arenas follow that, each from a page boundary */
+struct snapshot_arena {
+	char * at;		/* where it was */
+	size_t size;		/* ARENA_SIZE, or a large object's mapsize */
+	size_t off;		/* in the file */
+};
+
+static int snapshot_cmp(void const * x, void const * y) {
+	char * a = ((struct snapshot_arena const *) x)->at;
+	char * b = ((struct snapshot_arena const *) y)->at;
+	return a < b ? -1 : a > b;
+}
+
+/* write the whole heap to f, from the start, with root as what mapping
+ * it gives back. not in concurrent mode. returns 0, or -1 if it can't.
+ * the cycle it collects with doesn't evacuate, so root stays where the
+ * caller has it. */
+int gc_snapshot_write(FILE * f, struct obj * root) {
+	if (heap.concurrent)
+		return -1;
+	int evacuate = heap.evacuate;
+	heap.evacuate = 0;
+	gc_collect();
+	heap.evacuate = evacuate;
+	sweep_all();
+
+	struct snapshot_hdr h = { .magic = SNAPSHOT_MAGIC, .arena_log2 = ARENA_LOG2,
+		.unit_log2 = UNIT_LOG2, .root = root };
+	int i;
+	for( i = 0; i < NUM_TYPES; i++ ) {
+		h.units[i] = types[i].units;
+		h.tiny[i] = types[i].tiny;
+	}
+
+	struct arena * a;
+	for( a = heap.arenas; a; a = a->c.next )
+		h.n += arena_occupied(a) != 0;
+	h.n += heap.nlarge;
+	struct snapshot_arena * t = malloc( (h.n + 1) * sizeof(*t) );
+	if (!t)
+		die( 1, "snapshot table allocation failed" );
+
+	size_t n = 0;
+	for( a = heap.arenas; a; a = a->c.next )
+		if (arena_occupied(a))
+			t[n++] = (struct snapshot_arena) { (char *) a, ARENA_SIZE, 0 };
+	for( a = heap.large; a; a = a->c.next )
+		t[n++] = (struct snapshot_arena) { (char *) a, a->c.mapsize, 0 };
+	qsort( t, n, sizeof(*t), snapshot_cmp );
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t j, off = (sizeof(h) + n * sizeof(*t) + page - 1) & ~(page - 1);
+	for( j = 0; j < n; j++ ) {
+		t[j].off = off;
+		off += (t[j].size + page - 1) & ~(page - 1);
+	}
+
+	int ok = !fseek( f, 0, SEEK_SET ) && fwrite( &h, sizeof(h), 1, f ) == 1
+		&& fwrite( t, sizeof(*t), n, f ) == n;
+	for( j = 0; j < n && ok; j++ )
+		ok = !fseek( f, t[j].off, SEEK_SET )
+			&& fwrite( t[j].at, t[j].size, 1, f ) == 1;
+	free( t );
+	return fflush( f ) || !ok ? -1 : 0;
+}
+
+/* the snapshot being mapped: its table, and where each arena went */
+static struct {
+	struct snapshot_arena * t;
+	char ** to;
+	size_t n;
+} snap;
+
+/* an arena of the snapshot, where it was if that's free, otherwise
+ * anywhere aligned like an arena. null if it can't be mapped at all. */
+static char * snapshot_map_arena(int fd, struct snapshot_arena * e) {
+	char * p;
+#ifdef MAP_FIXED_NOREPLACE
+	p = mmap( e->at, e->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, e->off );
+	if (p == e->at)
+		return p;
+	if (p != MAP_FAILED)
+		munmap( p, e->size );	/* an old kernel, taking it as a hint */
+#endif
+
+	/* overmap, then trim to ARENA_SIZE alignment, as for large objects */
+	p = mmap( 0, e->size + ARENA_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if (p == MAP_FAILED)
+		return 0;
+	char * base = (char *)(((size_t)p + ARENA_SIZE - 1) & ~((size_t)ARENA_SIZE - 1));
+	if (base > p)
+		munmap( p, base - p );
+	if (base + e->size < p + e->size + ARENA_SIZE)
+		munmap( base + e->size, p + e->size + ARENA_SIZE - (base + e->size) );
+
+	if (mmap( base, e->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, e->off ) == MAP_FAILED) {
+		munmap( base, e->size );
+		return 0;
+	}
+	return base;
+}
+
+/* the arena of the snapshot a ptr from it was into, or snap.n */
+static size_t snapshot_find(struct obj * o) {
+	size_t lo = 0, hi = snap.n;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		struct snapshot_arena * e = &snap.t[mid];
+		if ((size_t) o < (size_t) e->at)
+			hi = mid;
+		else if ((size_t) o - (size_t) e->at >= e->size)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return snap.n;
+}
+
+/* where a ptr from the snapshot points now */
+static struct obj * snapshot_reloc(struct obj * o) {
+	size_t j = snapshot_find(o);
+	if (j == snap.n)
+		die( 1, "snapshot has a ptr %p to outside it", (void *) o );
+	return (struct obj *)(snap.to[j] + ((char *) o - snap.t[j].at));
+}
+
+/* the table has to be of arenas that could be: aligned, in order and
+ * apart, each a whole number of pages of the file after the table, with
+ * the root in one of them */
+static int snapshot_table_ok(struct snapshot_hdr * h, size_t fsize) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t j, start = sizeof(*h) + h->n * sizeof(*snap.t);
+	for( j = 0; j < h->n; j++ ) {
+		struct snapshot_arena * e = &snap.t[j];
+		if (e->size != ARENA_SIZE && (e->size < ARENA_SIZE || e->size & (page - 1)))
+			return 0;
+		if ((size_t) e->at & (ARENA_SIZE - 1) || (size_t) e->at > (size_t) -1 - e->size
+				|| (j && (size_t) e[-1].at + e[-1].size > (size_t) e->at))
+			return 0;
+		if (e->off & (page - 1) || e->off < start || e->off > fsize
+				|| e->size > fsize - e->off)
+			return 0;
+	}
+	return !h->root || snapshot_find(h->root) < h->n;
+}
+
+/* a mapped arena's header has to be one the heap could have written */
+static int snapshot_arena_ok(struct arena * a, size_t size) {
+	struct obj * o = (struct obj *)((char *) a + ARENA_HDR_UNITS * ALLOC_UNIT);
+	word_t carry = 0;
+	size_t i;
+
+	switch (a->c.kind) {
+	case ARENA_LARGE:
+		if (size <= ARENA_SIZE || a->c.mapsize != size || !IS_USED(a, ARENA_HDR_UNITS)
+				|| !(types[o->type].units || types[o->type].size))
+			return 0;
+		return (size_t) obj_units(&types[o->type], o) << UNIT_LOG2
+			<= size - ARENA_HDR_UNITS * ALLOC_UNIT;
+	case ARENA_TINY:
+		return size == ARENA_SIZE && a->c.type >= 0 && a->c.type < NUM_TYPES
+			&& types[a->c.type].tiny && a->c.units == types[a->c.type].units;
+	case ARENA_SMALL:
+		if (size != ARENA_SIZE)
+			return 0;
+		/* every run of used cells starts with an object, and objects
+		 * only start on used cells */
+		for( i = ARENA_HDR_UNITS / WORD_BITS; i < ARENA_WORDS; i++ ) {
+			word_t runs = a->used[i] & ~(a->used[i] << 1 | carry);
+			carry = a->used[i] >> (WORD_BITS - 1);
+			if (a->starts[i] & ~a->used[i] || runs & ~a->starts[i])
+				return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* and the root has to be an object in it */
+static int snapshot_root_ok(struct obj * root) {
+	if (!root)
+		return 1;
+	size_t j = snapshot_find(root), off = (char *) root - snap.t[j].at;
+	struct arena * a = (struct arena *) snap.to[j];
+	size_t cell = off >> UNIT_LOG2;
+	if (off & (ALLOC_UNIT - 1) || cell < ARENA_HDR_UNITS || !IS_USED(a, cell))
+		return 0;
+	if (a->c.kind == ARENA_LARGE)
+		return cell == ARENA_HDR_UNITS;
+	if (a->c.kind == ARENA_TINY)
+		return cell >= TINY_START && !(cell & (a->c.units - 1));
+	return !!(a->starts[cell / WORD_BITS] & BIT(cell));
+}
+
+static void visit_reloc(struct obj ** slot) {
+	if (*slot)
+		*slot = snapshot_reloc(*slot);
+}
+
+/* make a mapped arena part of the heap: a header with nothing in it but
+ * the used and start bits and what kind of arena it is, and its objects
+ * marked, as if just allocated, then swept like any other arena */
+static void snapshot_adopt(struct arena * a, int reloc) {
+	struct arena_meta_c c = a->c;
+	memset( &a->a, 0, sizeof(a->a) );
+	memset( &a->b, 0, sizeof(a->b) );
+	memset( a->old, 0, sizeof(a->old) );
+	memset( &a->c, 0, sizeof(a->c) );
+	a->c.kind = c.kind;
+	a->c.mapsize = c.mapsize;
+	a->c.type = c.type;
+	a->c.units = c.units;
+	if (a->c.kind == ARENA_TINY)
+		a->c.stride = ~(word_t)0 / (BIT(a->c.units) - 1);
+	a->c.mapped = 1;
+	a->c.pristine = 1;
+
+	size_t i;
+	word_t * mark = marks_of(a);
+	for( i = ARENA_HDR_UNITS / WORD_BITS; i < ARENA_WORDS; i++ )
+		mark[i] = a->used[i] ^ gc.sense;
+
+	if (a->c.kind == ARENA_LARGE) {
+		struct obj * o = (struct obj *)((char *) a + ARENA_HDR_UNITS * ALLOC_UNIT);
+		if (reloc)
+			trace(&types[o->type], o, visit_reloc);
+		a->c.next = heap.large;
+		heap.large = a;
+		heap.nlarge++;
+		heap.large_bytes += a->c.mapsize;
+		index_add(a);
+		large_sweep(a);
+		return;
+	}
+
+	if (a->c.kind == ARENA_TINY)
+		memset( grays_of(a), 0, ARENA_WORDS * sizeof(word_t) );
+
+	/* with a nursery, everything already there is old */
+	int cell = a->c.kind == ARENA_TINY ? TINY_START : ARENA_HDR_UNITS;
+	while ((reloc || generational()) && cell < ARENA_CELLS
+			&& (cell = next_used(a, cell, ARENA_CELLS)) < ARENA_CELLS) {
+		struct obj * o = (struct obj *)((char *) a + ((size_t) cell << UNIT_LOG2));
+		struct type * t = type_of(a, o);
+		if (generational())
+			SET_OLD(a, cell);
+		if (reloc)
+			trace(t, o, visit_reloc);
+		cell += obj_units(t, o);
+	}
+
+	a->c.next = heap.arenas;
+	heap.arenas = a;
+	heap.narenas++;
+	index_add(a);
+	sweep(a);
+}
+
+/* map a snapshot written by gc_snapshot_write into the heap, and return
+ * its root. null if it can't be, or doesn't match this program's types,
+ * or isn't one. not in concurrent mode. f can be closed afterwards. */
+struct obj * gc_snapshot_map(FILE * f) {
+	struct snapshot_hdr h;
+	struct stat st;
+	int fd = fileno(f);
+	if (heap.concurrent || fd < 0 || fstat( fd, &st ) || st.st_size < (off_t) sizeof(h)
+			|| pread( fd, &h, sizeof(h), 0 ) != sizeof(h)
+			|| memcmp( h.magic, SNAPSHOT_MAGIC, sizeof(h.magic) )
+			|| h.arena_log2 != ARENA_LOG2 || h.unit_log2 != UNIT_LOG2
+			|| h.n > ((size_t) st.st_size - sizeof(h)) / sizeof(*snap.t))
+		return 0;
+	int i;
+	for( i = 0; i < NUM_TYPES; i++ )
+		if (h.units[i] != types[i].units || h.tiny[i] != types[i].tiny)
+			return 0;
+
+	snap.n = h.n;
+	snap.t = malloc( (h.n + 1) * sizeof(*snap.t) );
+	snap.to = malloc( (h.n + 1) * sizeof(*snap.to) );
+	if (!snap.t || !snap.to)
+		die( 1, "snapshot table allocation failed" );
+	ssize_t len = h.n * sizeof(*snap.t);
+	size_t j, mapped = 0;
+	int moved = 0;
+	if (pread( fd, snap.t, len, sizeof(h) ) == len && snapshot_table_ok(&h, st.st_size))
+		for( mapped = 0; mapped < h.n; mapped++ ) {
+			if (!(snap.to[mapped] = snapshot_map_arena(fd, &snap.t[mapped])))
+				break;
+			moved |= snap.to[mapped] != snap.t[mapped].at;
+			if (!snapshot_arena_ok((struct arena *) snap.to[mapped], snap.t[mapped].size)) {
+				munmap( snap.to[mapped], snap.t[mapped].size );
+				break;
+			}
+		}
+
+	struct obj * root = 0;
+	if (mapped < h.n || !snapshot_root_ok(h.root)) {
+		for( j = 0; j < mapped; j++ )
+			munmap( snap.to[j], snap.t[j].size );
+	} else {
+		/* nothing in the heap can be half done when the arenas go in */
+		while (gc.phase != GC_IDLE && gc.phase != GC_SWEEP)
+			collect_step(GC_UNBOUNDED);
+		sweep_all();
+		for( j = 0; j < h.n; j++ )
+			snapshot_adopt((struct arena *) snap.to[j], moved);
+		root = moved && h.root ? snapshot_reloc(h.root) : h.root;
+	}
+	free( snap.t );
+	free( snap.to );
+	return root;
+}
+
+/* test driver code ------------------------------------------------------ */
+
+#define TYPE_PAIR 1
+#define TYPE_BUF 2
+#define TYPE_TPAIR 3
+
+struct pair {
+	struct obj hdr;
+	struct obj * car;
+	struct obj * cdr;
+};
+
+struct buf {
+	struct obj hdr;
+	size_t len;
+	char data[];
+};
+
+/* a pair without a header, for a tiny arena */
+struct tpair {
+	struct obj * car;
+	struct obj * cdr;
+};
+
+static size_t buf_size(struct obj * o) {
+	return sizeof(struct buf) + ((struct buf *) o)->len;
+}
+
+static struct pair * new_pair(struct obj * car, struct obj * cdr) {
+	struct pair * p = (struct pair *) heap_alloc(TYPE_PAIR, sizeof(struct pair));
+	if (!p)
+		die( 1, "failed: alloc pair" );
+	p->car = car;
+	p->cdr = cdr;
+
+	/* if marking, p is black, so whatever it was just given has to be
+	 * looked at again */
+	if (car || cdr)
+		write_barrier(&p->hdr);
+	return p;
+}
+
+static struct tpair * new_tpair(struct obj * car, struct obj * cdr) {
+	struct tpair * p = (struct tpair *) heap_alloc(TYPE_TPAIR, sizeof(struct tpair));
+	if (!p)
+		die( 1, "failed: alloc tiny pair" );
+	p->car = car;
+	p->cdr = cdr;
+	if (car || cdr)
+		write_barrier((struct obj *) p);
+	return p;
+}
+
+/* finalizers run, by the index they were registered with */
+#define WEAK_PAIRS (1000)
+static int finalized[WEAK_PAIRS + 1];
+
+static void count_final(void * arg) {
+	finalized[(size_t) arg]++;
+}
+
+/* empty arenas, other than ones being allocated from */
+static size_t count_empty(void) {
+	struct arena * a;
+	size_t n = 0;
+	for( a = heap.arenas; a; a = a->c.next )
+		n += !arena_occupied(a) && a != heap.current
+			&& !(a->c.kind == ARENA_TINY && a == heap.tiny[a->c.type].current);
+	return n;
+}
+
+/* a mutator for the concurrent test. it keeps every 10th pair it makes
+ * on a list, and points the head's car at each of the others in turn */
+#define MUT_THREADS (3)
+#define MUT_PAIRS (300000)
+
+static void * mutator(void * arg) {
+	struct obj ** root = arg;
+	gc_thread_attach();
+	gc_add_root(root);
+
+	int i;
+	for( i = 0; i < MUT_PAIRS; i++ ) {
+		if (i % 10 == 0)
+			*root = &new_pair(0, *root)->hdr;
+		else {
+			/* some tiny, for the locked path */
+			struct obj * p = i % 10 == 5
+				? (struct obj *) new_tpair(0, 0)
+				: &new_pair(0, 0)->hdr;
+			((struct pair *) *root)->car = p;
+			write_barrier(*root);
+		}
+		gc_safepoint();
+	}
+
+	gc_thread_detach();
+	return 0;
+}
+
+/* benchmarks -------------------------------------------------------------
+ *
+ * `incgc bench` (or `make bench`) runs these instead of the tests. each
+ * one starts from an empty heap and a fixed seed, so runs are comparable,
+ * and reports the time per op and the longest pause in it. pauses come
+ * from the stats, so they're only there built with GC_STATS, as `make
+ * bench` builds them.
+ */
+
+static unsigned long long bench_seed;
+
+static inline unsigned bench_rand(void) {
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return (unsigned) bench_seed;
+}
+
+static inline unsigned long long bench_ns(void) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct obj * bench_root;
+
+static void bench_start(void) {
+	bench_root = 0;
+	gc_collect();
+	gc_reset_stats();
+	bench_seed = 88172645463325252ull;
+}
+
+static void bench_report(char const * name, unsigned long long t, size_t ops, char const * op) {
+	struct gc_stats total;
+	gc_get_stats(0, &total);
+	printf( "%-14s %10.2f ns/%-6s", name, (double) t / ops, op );
+	if (GC_STATS)
+		printf( " %8.3f ms max pause, %u cycles", total.max_pause_ns / 1e6, total.cycles );
+	printf( ", %zu arenas\n", heap.narenas );
+}
+
+/* small objects, all garbage, with pacing doing the collecting by
+ * assists from allocation. built with stats, the time spent in collector
+ * steps is told apart from the rest, which is allocation (lazy sweeping
+ * included), and reported a cycle at a time. */
+#define BENCH_ALLOCS (1000000)
+
+static void bench_alloc(void) {
+	int i;
+	heap.gc_percent = 100;
+	bench_start();
+	sweep_all();
+	gc_scavenge();	/* from a small heap */
+	unsigned epoch = gc.epoch;
+	unsigned long long t0 = bench_ns();
+	for( i = 0; i < BENCH_ALLOCS; i++ )
+		new_pair(0, 0);
+	unsigned long long t = bench_ns() - t0;
+	unsigned cycles = gc.epoch - epoch;
+	heap.gc_percent = 0;
+	bench_report("alloc", t, BENCH_ALLOCS, "alloc");
+
+	struct gc_stats total;
+	gc_get_stats(0, &total);
+	unsigned long long collecting = total.span_ns[SPAN_ROOTS] + total.span_ns[SPAN_MARK]
+		+ total.span_ns[SPAN_WEAK] + total.span_ns[SPAN_SWEEP];
+	if (GC_STATS && cycles && collecting < t)
+		printf( "%-14s %10.2f ns/alloc, %.2f us/cycle over %u cycles\n", "alloc/split",
+			(double) (t - collecting) / BENCH_ALLOCS, collecting / 1e3 / cycles, cycles );
+}
+
+/* binary trees: one long lived tree, and lots of short lived ones */
+#define TREE_DEPTH (14)
+
+static struct obj * tree_new(int depth) {
+	gc_step( 8 );
+	if (!depth)
+		return &new_pair(0, 0)->hdr;
+
+	struct obj * l = 0;
+	struct gc_frame f = { .n = 1, .slots = { &l } };
+	gc_frame_push( &f );
+	l = tree_new(depth - 1);
+	struct obj * r = tree_new(depth - 1);
+	struct obj * t = &new_pair(l, r)->hdr;
+	gc_frame_pop( &f );
+	return t;
+}
+
+static size_t tree_check(struct obj * t) {
+	struct pair * p = (struct pair *) t;
+	return 1 + (p->car ? tree_check(p->car) + tree_check(p->cdr) : 0);
+}
+
+static void bench_trees(void) {
+	size_t nodes = 0;
+	int d, i;
+	bench_start();
+	unsigned long long t0 = bench_ns();
+	bench_root = tree_new(TREE_DEPTH);
+	nodes += tree_check(bench_root);
+	for( d = 4; d <= TREE_DEPTH; d += 2 )
+		for( i = 0; i < 1 << (TREE_DEPTH - d + 4); i++ )
+			nodes += tree_check(tree_new(d));
+	if (tree_check(bench_root) != (2u << TREE_DEPTH) - 1)
+		die( 1, "failed: long lived tree lost nodes" );
+	bench_report("trees", bench_ns() - t0, nodes, "node");
+}
+
+/* a queue of pairs which the oldest drop off, so everything lives a
+ * while and then dies */
+#define LIST_LIVE (100000)
+#define LIST_OPS (1000000)
+
+static void bench_list(void) {
+	int i;
+	bench_start();
+	unsigned long long t0 = bench_ns();
+	struct pair * tail = new_pair(0, 0);
+	bench_root = &tail->hdr;
+	for( i = 0; i < LIST_OPS; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		tail->cdr = &p->hdr;
+		write_barrier(&tail->hdr);
+		tail = p;
+		if (i >= LIST_LIVE) {
+			bench_root = ((struct pair *) bench_root)->cdr;
+			gc_root_barrier( &bench_root );
+		}
+		gc_step( 8 );
+	}
+	bench_report("list", bench_ns() - t0, LIST_OPS, "op");
+}
+
+/* one incremental cycle over whatever's rooted, with the time taken to
+ * mark and to sweep */
+static void bench_cycle(unsigned long long * mark_ns, unsigned long long * sweep_ns) {
+	unsigned long long t0 = bench_ns();
+	do
+		gc_step( 4096 );
+	while (gc_get_phase() != GC_SWEEP);
+	unsigned long long t1 = bench_ns();
+	while (gc_get_phase() != GC_IDLE)
+		gc_step( 4096 );
+	*mark_ns += t1 - t0;
+	*sweep_ns += bench_ns() - t1;
+}
+
+/* a binary tree of all n pairs, linked in a random order, so that
+ * neither the cache nor the hardware prefetcher can see what's next */
+static struct obj * scattered_tree(int n) {
+	struct pair ** p = malloc( n * sizeof(*p) );
+	int i;
+	if (!p)
+		die( 1, "failed: bench allocation" );
+	for( i = 0; i < n; i++ ) {
+		p[i] = new_pair(0, bench_root);
+		bench_root = &p[i]->hdr;	/* so they stay live */
+	}
+	for( i = n - 1; i > 0; i-- ) {
+		int j = bench_rand() % (i + 1);
+		struct pair * t = p[i];
+		p[i] = p[j];
+		p[j] = t;
+	}
+	for( i = 0; i < n; i++ ) {
+		p[i]->car = 2 * i + 1 < n ? &p[2 * i + 1]->hdr : 0;
+		p[i]->cdr = 2 * i + 2 < n ? &p[2 * i + 2]->hdr : 0;
+		write_barrier(&p[i]->hdr);
+	}
+	struct obj * root = &p[0]->hdr;
+	free( p );
+	return root;
+}
+
+/* marking a graph that's all live: as wide as it can be, as deep, or
+ * wide and scattered, and with heap.prefetch or not */
+#define MARK_NODES (1 << 20)
+#define MARK_CYCLES (5)
+
+static void bench_mark(int shape) {
+	static char const * const shapes[] = { "wide", "deep", "scattered" };
+	unsigned long long mark_ns = 0, sweep_ns = 0;
+	int i;
+	heap.lazy_sweep = 0;
+	bench_start();
+	if (shape == 1)
+		for( i = 0; i < MARK_NODES; i++ )
+			bench_root = &new_pair(0, bench_root)->hdr;
+	else if (shape == 2)
+		bench_root = scattered_tree(MARK_NODES);
+	else
+		bench_root = tree_new(19);
+	gc_collect();
+	gc_reset_stats();
+
+	for( i = 0; i < MARK_CYCLES; i++ )
+		bench_cycle(&mark_ns, &sweep_ns);
+	heap.lazy_sweep = 1;
+	char name[32];
+	snprintf( name, sizeof(name), "%s %s",
+		heap.prefetch ? "prefetch" : "mark", shapes[shape] );
+	bench_report(name, mark_ns, (size_t) MARK_NODES * MARK_CYCLES, "obj");
+}
+
+/* sweeping arenas with one pair in eight live */
+#define SWEEP_PAIRS (2000000)
+#define SWEEP_ROUNDS (4)
+
+static void bench_sweep(void) {
+	unsigned long long mark_ns = 0, sweep_ns = 0;
+	size_t swept = 0;
+	int i, r;
+	heap.lazy_sweep = 0;
+	bench_start();
+	for( r = 0; r < SWEEP_ROUNDS; r++ ) {
+		bench_root = 0;
+		for( i = 0; i < SWEEP_PAIRS; i++ ) {
+			struct pair * p = new_pair(0, 0);
+			if (i % 8 == 0) {
+				p->cdr = bench_root;
+				bench_root = &p->hdr;
+			}
+		}
+		swept += heap.narenas;
+		bench_cycle(&mark_ns, &sweep_ns);
+	}
+	heap.lazy_sweep = 1;
+	bench_report("sweep", sweep_ns, swept, "arena");
+}
+
+/* pointer stores all over a live graph, with marking on nearly always */
+#define BARRIER_NODES (65536)
+#define BARRIER_OPS (4000000)
+
+static void bench_barrier(void) {
+	struct pair ** nodes = malloc( BARRIER_NODES * sizeof(*nodes) );
+	int i;
+	if (!nodes)
+		die( 1, "failed: alloc bench nodes" );
+	bench_start();
+	for( i = 0; i < BARRIER_NODES; i++ ) {
+		nodes[i] = new_pair(0, bench_root);
+		bench_root = &nodes[i]->hdr;
+	}
+
+	unsigned long long t0 = bench_ns();
+	for( i = 0; i < BARRIER_OPS; i++ ) {
+		struct pair * p = nodes[bench_rand() % BARRIER_NODES];
+		p->car = &nodes[bench_rand() % BARRIER_NODES]->hdr;
+		write_barrier(&p->hdr);
+		if (i % 16 == 0)
+			gc_step( 16 );
+	}
+	bench_report("barrier", bench_ns() - t0, BARRIER_OPS, "store");
+	free(nodes);
+}
+
+static int bench(void) {
+	int i;
+	heap.size_classes = 1;
+	heap.lazy_sweep = 1;
+	gc_add_root( &bench_root );
+
+	bench_alloc();
+	bench_trees();
+	bench_list();
+	for( i = 0; i < 2; i++ ) {
+		heap.prefetch = i;
+		bench_mark(0);
+		bench_mark(1);
+		bench_mark(2);
+	}
+	heap.prefetch = 0;
+	bench_sweep();
+	bench_barrier();
+	return 0;
+}
+
+int main(int argc, char ** argv) {
+	printf( "sizes: arena meta: %zd a: %zd b: %zd: gs: %zd\n",
+			sizeof(struct arena),
+			sizeof(struct arena_meta_a),
+			sizeof(struct arena_meta_b),
+			sizeof(struct gs));
+
+	size_t const pair_ptrs[] = {
+		offsetof(struct pair, car),
+		offsetof(struct pair, cdr),
+	};
+	type_register( TYPE_PAIR, sizeof(struct pair), pair_ptrs, 2 );
+	type_register_fn( TYPE_BUF, 0, buf_size, 0 );
+	size_t const tpair_ptrs[] = {
+		offsetof(struct tpair, car),
+		offsetof(struct tpair, cdr),
+	};
+	type_register_tiny( TYPE_TPAIR, sizeof(struct tpair), tpair_ptrs, 2 );
+
+	/* arenas come out of a region until it fills, after which they
+	 * come from the allocator */
+	heap.reserve = 64 << 20;
+	heap.huge_pages = 1;
+
+	if (argc > 1 && !strcmp( argv[1], "bench" ))
+		return bench();
+
+	struct arena * a = arena_new();
+	struct obj * o = arena_alloc(a, 32);
+
+	if (!o)
+		die( 1, "failed: alloc object from %p", a );
+
+	heap.current = a;
+
+	/* (1 . (2 . nil)) and some garbage */
+	struct pair * tail = new_pair(0, 0);
+	struct pair * garbage = new_pair(0, (struct obj *) tail);
+	struct pair * head = new_pair((struct obj *) tail, 0);
+
+	struct obj * root = &head->hdr;
+	gc_add_root( &root );
+
+	/* small steps, so every phase gets split */
+	do
+		gc_step( 1 );
+	while (gc_get_phase() != GC_SWEEP);
+
+	if (!IS_MARKED(a, CELL_OF(a, head)) || !IS_MARKED(a, CELL_OF(a, tail)))
+		die( 1, "failed: reachable pair not marked" );
+	if (IS_MARKED(a, CELL_OF(a, garbage)))
+		die( 1, "failed: unreachable pair marked" );
+
+	while (gc_get_phase() != GC_IDLE)
+		gc_step( 1 );
+
+	if (!IS_USED(a, CELL_OF(a, head)) || !IS_USED(a, CELL_OF(a, tail)))
+		die( 1, "failed: reachable pair swept" );
+	if (IS_USED(a, CELL_OF(a, garbage)) || IS_USED(a, CELL_OF(a, o)))
+		die( 1, "failed: garbage survived" );
+
+	gc_remove_root( &root );
+	gc_collect();
+	if (IS_USED(a, CELL_OF(a, head)))
+		die( 1, "failed: unrooted pair survived" );
+
+	/* a few MB of buffer hung off a pair gets its own mapping */
+	size_t len = 5 << 20;
+	struct buf * b = (struct buf *) heap_alloc(TYPE_BUF, sizeof(struct buf) + len);
+	if (!b)
+		die( 1, "failed: alloc large buffer" );
+	b->len = len;
+	memset( b->data, 0x55, len );
+	if (get_arena(&b->hdr)->c.kind != ARENA_LARGE)
+		die( 1, "failed: large buffer not in a large object" );
+
+	root = &new_pair(&b->hdr, 0)->hdr;
+	gc_add_root( &root );
+	gc_collect();
+	if (heap.nlarge != 1 || b->data[len - 1] != 0x55)
+		die( 1, "failed: reachable large buffer freed" );
+	if (!is_heap_ptr(root) || !is_heap_ptr(&b->data[len - 1]) || is_heap_ptr(&root))
+		die( 1, "failed: arena index is wrong" );
+	root = 0;
+	gc_collect();
+	if (heap.nlarge)
+		die( 1, "failed: unreachable large buffer kept" );
+	if (is_heap_ptr(&b->data[len - 1]))
+		die( 1, "failed: freed large buffer still in the arena index" );
+
+	/* keep a long list alive while churning through garbage in between
+	 * its cells; the heap should stop growing once cycles keep up. the
+	 * holes this leaves are what the size class lists are for. */
+	heap.size_classes = 1;
+	heap.lazy_sweep = 1;
+	root = 0;
+	int i;
+	for( i = 0; i < 1000000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 10 == 0) {
+			p->cdr = root;
+			write_barrier(&p->hdr);
+			root = &p->hdr;
+		}
+		gc_step( 8 );
+	}
+
+	gc_collect();
+	len = 0;
+	for( o = root; o; o = ((struct pair *) o)->cdr )
+		len++;
+	if (len != 100000)
+		die( 1, "failed: live list has %zu cells", len );
+	size_t live_arenas = len * sizeof(struct pair) / ARENA_MAX_OBJ + 1;
+	if (heap.narenas > 2 * live_arenas)
+		die( 1, "failed: heap grew to %zu arenas", heap.narenas );
+
+	/* marking through the prefetch ring, with cars hung off the list
+	 * behind the marker's back */
+	heap.prefetch = 1;
+	struct obj * ahead = 0;
+	gc_add_root( &ahead );
+	for( i = 0; i < 200000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 10 == 0) {
+			p->cdr = ahead;
+			write_barrier(&p->hdr);
+			ahead = &p->hdr;
+		} else if (ahead && i % 10 == 5) {
+			((struct pair *) ahead)->car = &p->hdr;
+			write_barrier(ahead);
+		}
+		gc_step( 4 );
+	}
+	gc_collect();
+	for( i = 0, o = ahead; o; o = ((struct pair *) o)->cdr, i++ ) {
+		struct obj * car = ((struct pair *) o)->car;
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o))
+				|| !car || !IS_USED(get_arena(car), CELL_OF(get_arena(car), car)))
+			die( 1, "failed: prefetch ring lost a pair" );
+	}
+	if (i != 20000)
+		die( 1, "failed: prefetched list has %d cells", i );
+	heap.prefetch = 0;
+	gc_remove_root( &ahead );
+
+	/* the same again, marking with several threads, and with the list
+	 * cut in half */
+	heap.mark_threads = 4;
+	heap.lazy_sweep = 0;
+	for( i = 0, o = root; i < 50000 - 1; i++ )
+		o = ((struct pair *) o)->cdr;
+	((struct pair *) o)->cdr = 0;
+	gc_collect();
+
+	for( i = 0, o = root; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: parallel mark lost a live pair" );
+	if (i != 50000)
+		die( 1, "failed: live list has %d cells", i );
+
+	/* generational: the list is old, and young pairs churn through the
+	 * nursery, with every 100th of them kept on a chain hung off it */
+	heap.generational = 1;
+	heap.nursery_arenas = 8;
+	gc_collect();
+
+	struct pair * old = (struct pair *) root;
+	size_t gen_arenas = heap.narenas;
+	for( i = 0; i < 1000000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 100 == 0) {
+			p->car = old->car;
+			old->car = &p->hdr;
+			write_barrier(&old->hdr);
+		}
+	}
+	if (!gc.minors)
+		die( 1, "failed: no minor collections" );
+	if (heap.narenas > gen_arenas + 2 * heap.nursery_arenas)
+		die( 1, "failed: heap grew from %zu to %zu arenas with minor collections",
+			gen_arenas, heap.narenas );
+
+	/* the chain has to survive both kinds of collection */
+	int pass;
+	for( pass = 0; pass < 2; pass++ ) {
+		if (pass)
+			gc_collect();
+		for( i = 0, o = old->car; o; o = ((struct pair *) o)->car, i++ )
+			if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+				die( 1, "failed: lost a promoted pair" );
+		if (i != 10000)
+			die( 1, "failed: chain has %d pairs", i );
+	}
+	old->car = 0;
+	heap.generational = 0;
+
+	/* evacuation: keep every 16th pair of the list, each with a small
+	 * buf hung off it, so that the arenas it was in are mostly empty */
+	for( i = 0, o = root; o; o = ((struct pair *) o)->cdr, i++ ) {
+		struct pair * p = (struct pair *) o;
+		struct buf * nb = (struct buf *) heap_alloc(TYPE_BUF, sizeof(struct buf) + 8);
+		nb->len = 8;
+		memcpy( nb->data, &i, sizeof(i) );
+		p->car = &nb->hdr;
+
+		struct obj * next = p->cdr;
+		int skip;
+		for( skip = 0; skip < 15 && next; skip++ )
+			next = ((struct pair *) next)->cdr;
+		p->cdr = next;
+	}
+	gc_collect();
+
+	size_t sparse_arenas = heap.narenas;
+	heap.evacuate = 25;
+	gc_collect();
+	heap.evacuate = 0;
+
+	for( i = 0, o = root; o; o = ((struct pair *) o)->cdr, i++ ) {
+		struct buf * cb = (struct buf *) ((struct pair *) o)->car;
+		int n;
+		memcpy( &n, cb->data, sizeof(n) );
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o))
+				|| !IS_USED(get_arena(&cb->hdr), CELL_OF(get_arena(&cb->hdr), &cb->hdr))
+				|| cb->len != 8 || n != i)
+			die( 1, "failed: evacuation lost pair %d", i );
+	}
+	if (i != 50000 / 16)
+		die( 1, "failed: evacuated list has %d cells", i );
+	if (heap.narenas >= sparse_arenas)
+		die( 1, "failed: evacuation left %zu arenas of %zu",
+			heap.narenas, sparse_arenas );
+	if (region.nspare != sparse_arenas - heap.narenas)
+		die( 1, "failed: %zu arenas went back to the region, not %zu",
+			region.nspare, sparse_arenas - heap.narenas );
+	printf( "evacuation: %zu arenas down to %zu, %zu in huge page groups, "
+		"%zuK on huge pages\n", sparse_arenas, heap.narenas,
+		heap.nhuge_advised, region_huge_bytes() >> 10 );
+
+	/* scavenging: a spike of garbage leaves empty arenas, which go back
+	 * when asked, but for the ones kept. then all of them, under
+	 * pressure, then on a timer, both from gc_step. */
+	int round;
+	for( round = 0; round < 3; round++ ) {
+		for( i = 0; i < 40 * ARENA_SIZE / (int) sizeof(struct pair); i++ )
+			new_pair(0, 0);
+		gc_collect();
+		sweep_all();
+
+		size_t spiked = heap.narenas, empty = count_empty();
+		int keep = round == 1 ? 0 : 4;
+		if (empty < 16)
+			die( 1, "failed: spike left only %zu empty arenas", empty );
+		heap.scavenge_keep = 4;
+		if (round == 0)
+			gc_scavenge();
+		else if (round == 1) {
+			gc_memory_pressure();
+			gc_step( 0 );
+		} else {
+			heap.scavenge_ms = 1;
+			usleep( 2000 );
+			gc_step( 0 );
+			heap.scavenge_ms = 0;
+		}
+
+		size_t left = count_empty();
+		if (left != (size_t) keep || spiked - heap.narenas != empty - left)
+			die( 1, "failed: scavenging left %zu of %zu empty arenas, "
+				"and %zu of %zu", left, empty, heap.narenas, spiked );
+		if (round != 1)
+			continue;
+
+		struct gc_stats scavenged;
+		gc_get_stats(0, &scavenged);
+		if (GC_STATS && (scavenged.scavenged_bytes < 2 * 16 * ARENA_SIZE
+				|| !scavenged.rss_after))
+			die( 1, "failed: stats have %zu bytes scavenged",
+				scavenged.scavenged_bytes );
+		printf( "scavenging: %zu arenas down to %zu, rss %zuK to %zuK\n",
+			spiked, heap.narenas, scavenged.rss_before >> 10,
+			scavenged.rss_after >> 10 );
+	}
+	heap.scavenge_keep = 0;
+	gc_collect();
+
+	/* tiny pairs, on a list among garbage of both sizes, through some
+	 * minors, then incremental and parallel cycles */
+	struct obj * tiny = 0;
+	gc_add_root( &tiny );
+	heap.generational = 1;
+	for( i = 0; i < 300000; i++ ) {
+		new_pair(0, 0);
+		struct tpair * tp = new_tpair(0, 0);
+		if (i % 10 == 0) {
+			/* allocating can collect, so it has to be reachable
+			 * before its car is made */
+			tp->cdr = tiny;
+			write_barrier((struct obj *) tp);
+			tiny = (struct obj *) tp;
+			tp->car = &new_pair(0, 0)->hdr;
+			write_barrier((struct obj *) tp);
+		}
+	}
+	if (heap.tiny[TYPE_TPAIR].current->c.kind != ARENA_TINY
+			|| (size_t) heap.tiny[TYPE_TPAIR].current & (ARENA_SIZE - 1))
+		die( 1, "failed: tiny pairs not in a tiny arena" );
+	heap.generational = 0;
+	for( pass = 0; pass < 3; pass++ ) {
+		if (pass == 1)
+			for( i = 0; i < 200000; i++ ) {
+				new_tpair(0, 0);
+				gc_step( 8 );
+			}
+		if (pass == 2)
+			gc_collect();
+		for( i = 0, o = tiny; o; o = ((struct tpair *) o)->cdr, i++ ) {
+			struct arena * ta = get_arena(o);
+			struct obj * car = ((struct tpair *) o)->car;
+			if (ta->c.kind != ARENA_TINY || !IS_USED(ta, CELL_OF(ta, o))
+					|| !IS_USED(get_arena(car), CELL_OF(get_arena(car), car)))
+				die( 1, "failed: lost a tiny pair" );
+		}
+		if (i != 30000)
+			die( 1, "failed: tiny chain has %d pairs", i );
+	}
+	/* a unit each, with nothing else left in their arenas */
+	size_t tiny_cells = 0;
+	struct arena * ta;
+	for( ta = heap.arenas; ta; ta = ta->c.next )
+		if (ta->c.kind == ARENA_TINY)
+			tiny_cells += arena_occupied(ta);
+	if (tiny_cells != 30000)
+		die( 1, "failed: 30000 tiny pairs take %zu cells", tiny_cells );
+	gc_remove_root( &tiny );
+
+	/* a list only a shadow stack frame knows about, and a pinned pair,
+	 * through incremental cycles and one which moves everything it can */
+	struct obj * local = 0;
+	struct gc_frame frame = { .n = 1, .slots = { &local } };
+	gc_frame_push( &frame );
+	struct pair * pinned = new_pair(0, 0);
+	gc_handle h = gc_pin(&pinned->hdr);
+	for( i = 0; i < 200000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 200 == 0) {
+			p->cdr = local;
+			write_barrier(&p->hdr);
+			local = &p->hdr;
+		}
+		gc_step( 8 );
+	}
+
+	heap.evacuate = 100;
+	gc_collect();
+	heap.evacuate = 0;
+	for( i = 0, o = local; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: lost a pair held by a frame" );
+	if (i != 1000)
+		die( 1, "failed: frame's list has %d cells", i );
+	if (gc_pinned(h) != &pinned->hdr
+			|| !IS_USED(get_arena(&pinned->hdr), CELL_OF(get_arena(&pinned->hdr), &pinned->hdr)))
+		die( 1, "failed: pinned pair moved or was freed" );
+
+	gc_frame_pop( &frame );
+	gc_unpin(h);
+	gc_collect();
+	if (IS_USED(get_arena(&pinned->hdr), CELL_OF(get_arena(&pinned->hdr), &pinned->hdr)))
+		die( 1, "failed: unpinned pair survived" );
+
+	/* roots are only scanned once a cycle: a pair taken out of a list
+	 * and put in a root the collector has already been past, while the
+	 * list's head is still gray, is kept by the root barrier */
+	struct obj * behind = 0, * held = 0;
+	gc_add_root( &behind );
+	for( i = 0; i < 1000; i++ )
+		held = &new_pair(0, held)->hdr;
+	gc_add_root( &held );
+	while (gc_get_phase() != GC_MARK)
+		gc_step( 1 );
+	struct pair * first = (struct pair *) held;
+	struct obj * moved = first->cdr;
+	behind = moved;
+	gc_root_barrier( &behind );
+	first->cdr = 0;
+	write_barrier( &first->hdr );
+	gc_collect();
+	if (!IS_USED(get_arena(moved), CELL_OF(get_arena(moved), moved)))
+		die( 1, "failed: lost a pair moved into a scanned root" );
+	gc_remove_root( &held );
+	gc_remove_root( &behind );
+
+	/* nor is a pin skipped when a root is dropped with the collector
+	 * between the roots and the pins, which are numbered after them */
+	gc_add_root( &behind );
+	struct pair * lone = new_pair(0, 0);
+	h = gc_pin(&lone->hdr);
+	while (gc_get_phase() != GC_ROOTS || gc.root_cursor < nroots)
+		gc_step( 1 );
+	gc_remove_root( &behind );
+	gc_collect();
+	if (gc_pinned(h) != &lone->hdr
+			|| !IS_USED(get_arena(&lone->hdr), CELL_OF(get_arena(&lone->hdr), &lone->hdr)))
+		die( 1, "failed: pin skipped after a root was dropped" );
+	gc_unpin(h);
+
+	/* weak slots to pairs, every other one of which is also on a list,
+	 * and finalizers on all of them: through a cycle in small steps,
+	 * with a slot dropped partway through the weak pass, then a minor,
+	 * and a cycle which moves what the slots point at */
+	struct obj * weak[WEAK_PAIRS], * strong = 0;
+	gc_add_root( &strong );
+	for( i = 0; i < WEAK_PAIRS; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		weak[i] = &p->hdr;
+		gc_add_weak( &weak[i] );
+		gc_finalize( &p->hdr, count_final, (void *)(size_t) i );
+		if (i % 2 == 0) {
+			p->cdr = strong;
+			write_barrier(&p->hdr);
+			strong = &p->hdr;
+		}
+	}
+	int weak_steps = 0;
+	do {
+		gc_step( 64 );
+		if (gc_get_phase() == GC_WEAK) {
+			if (!weak_steps++)
+				gc_remove_weak( &weak[0] );
+			if (gc_weak_get( &weak[WEAK_PAIRS - 1] ))
+				die( 1, "failed: weak slot read back garbage" );
+		}
+	} while (gc_get_phase() != GC_SWEEP);
+	if (weak_steps < 2)
+		die( 1, "failed: weak pass took %d steps", weak_steps );
+	gc_finalize_wait();
+	for( i = 0; i < WEAK_PAIRS; i++ )
+		if ((i % 2 ? weak[i] != 0 : weak[i] == 0) || finalized[i] != i % 2)
+			die( 1, "failed: weak slot %d is %p, finalized %d times",
+				i, (void *) weak[i], finalized[i] );
+
+	heap.generational = 1;
+	struct obj * young = &new_pair(0, 0)->hdr;
+	gc_add_weak( &young );
+	gc_finalize( young, count_final, (void *)(size_t) WEAK_PAIRS );
+	gc_minor();
+	heap.generational = 0;
+	gc_finalize_wait();
+	if (young || finalized[WEAK_PAIRS] != 1)
+		die( 1, "failed: minor kept a young pair only a weak slot has" );
+	gc_remove_weak( &young );
+
+	heap.evacuate = 100;
+	gc_collect();
+	heap.evacuate = 0;
+	for( i = WEAK_PAIRS - 2, o = strong; o; o = ((struct pair *) o)->cdr, i -= 2 )
+		if (i > 0 && weak[i] != o)
+			die( 1, "failed: weak slot %d didn't follow its pair", i );
+	gc_finalize_wait();
+	for( i = 0; i < WEAK_PAIRS; i++ ) {
+		if (finalized[i] != i % 2)
+			die( 1, "failed: pair %d finalized %d times", i, finalized[i] );
+		gc_remove_weak( &weak[i] );
+	}
+	gc_remove_root( &strong );
+	gc_collect();
+	gc_finalize_wait();
+	for( i = 0; i < WEAK_PAIRS; i++ )
+		if (finalized[i] != 1)
+			die( 1, "failed: pair %d finalized %d times", i, finalized[i] );
+
+	/* a snapshot of a tree, a large buffer and a chain of tiny pairs,
+	 * mapped back in next to the heap it was taken from, so that it
+	 * can't go where it was and has to be relocated. then it should
+	 * survive cycles, and go once it is dropped. */
+	struct obj * snapped = 0, * copy = 0;
+	gc_add_root( &snapped );
+	gc_add_root( &copy );
+	snapped = &new_pair(tree_new(10), 0)->hdr;
+	struct buf * snap_buf = (struct buf *) heap_alloc(TYPE_BUF, sizeof(struct buf) + (1 << 20));
+	if (!snap_buf)
+		die( 1, "failed: alloc large buffer" );
+	snap_buf->len = 1 << 20;
+	memset( snap_buf->data, 0x33, snap_buf->len );
+	((struct pair *) snapped)->cdr = &new_pair(&snap_buf->hdr, 0)->hdr;
+	write_barrier(snapped);
+	for( i = 0; i < 1000; i++ ) {
+		struct pair * sp = (struct pair *) ((struct pair *) snapped)->cdr;
+		sp->cdr = (struct obj *) new_tpair(0, sp->cdr);
+		write_barrier(&sp->hdr);
+	}
+
+	FILE * img = tmpfile();
+	if (!img || gc_snapshot_write(img, snapped))
+		die( 1, "failed: write snapshot" );
+	size_t snap_arenas = heap.narenas, snap_large = heap.nlarge;
+	copy = gc_snapshot_map(img);
+	fclose( img );
+	if (!copy || copy == snapped || !get_arena(copy)->c.mapped)
+		die( 1, "failed: snapshot mapped to %p", (void *) copy );
+	if (heap.narenas <= snap_arenas || heap.nlarge != 2 * snap_large)
+		die( 1, "failed: snapshot gave %zu arenas and %zu large objects",
+			heap.narenas - snap_arenas, heap.nlarge - snap_large );
+
+	snapped = 0;
+	for( pass = 0; pass < 2; pass++ ) {
+		if (pass)
+			for( i = 0; i < 100000; i++ ) {
+				new_pair(0, 0);
+				gc_step( 8 );
+			}
+		gc_collect();
+		struct pair * sp = (struct pair *) ((struct pair *) copy)->cdr;
+		struct buf * sb = (struct buf *) sp->car;
+		if (tree_check(((struct pair *) copy)->car) != (2u << 10) - 1
+				|| !get_arena(&sb->hdr)->c.mapped || sb->len != 1 << 20
+				|| sb->data[0] != 0x33 || sb->data[sb->len - 1] != 0x33)
+			die( 1, "failed: snapshot lost its tree or buffer" );
+		for( i = 0, o = sp->cdr; o; o = ((struct tpair *) o)->cdr, i++ )
+			if (get_arena(o)->c.kind != ARENA_TINY || !IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+				die( 1, "failed: snapshot lost a tiny pair" );
+		if (i != 1000)
+			die( 1, "failed: snapshot's tiny chain has %d pairs", i );
+	}
+
+	copy = 0;
+	size_t snap_mapped = 0;
+	for( ta = heap.arenas; ta; ta = ta->c.next )
+		snap_mapped += ta->c.mapped;
+	heap.evacuate = 100;
+	gc_collect();
+	heap.evacuate = 0;
+	size_t snap_left = 0;
+	for( ta = heap.arenas; ta; ta = ta->c.next ) {
+		if (ta->c.mapped && arena_occupied(ta))
+			die( 1, "failed: dropped snapshot left objects behind" );
+		snap_left += ta->c.mapped;
+	}
+	if (heap.nlarge != snap_large - 1 || snap_left >= snap_mapped)
+		die( 1, "failed: dropped snapshot kept %zu of %zu arenas",
+			snap_left, snap_mapped );
+	gc_remove_root( &copy );
+	gc_remove_root( &snapped );
+
+	/* conservative: a list nothing knows about but a local, which only
+	 * points into the middle of its head */
+	heap.conservative = 1;
+	char * volatile inner = 0;
+	for( i = 0, o = 0; i < 1000; i++ ) {
+		struct pair * p = new_pair(0, o);
+		o = &p->hdr;
+		inner = (char *) &p->cdr;
+	}
+	for( i = 0; i < 100000; i++ ) {
+		new_pair(0, 0);
+		gc_step( 8 );
+	}
+	gc_collect();
+	for( i = 0, o = (struct obj *)(inner - offsetof(struct pair, cdr)); o;
+			o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: lost a pair only the stack points at" );
+	if (i != 1000)
+		die( 1, "failed: stack's list has %d cells", i );
+
+	/* a word anywhere in an object finds it, though its zeroed data
+	 * could pass for headers */
+	struct buf * cb = (struct buf *) heap_alloc(TYPE_BUF, sizeof(struct buf) + 256);
+	struct pair * cp = new_pair(0, 0);
+	cb->len = 256;
+	if (conservative_find((word_t) &cb->data[250]) != &cb->hdr
+			|| conservative_find((word_t) &cp->cdr) != &cp->hdr)
+		die( 1, "failed: conservative scan didn't find an object from inside it" );
+
+	/* a thread still attached when the collector stops gives up its tlab,
+	 * or serial sweeping would never clear the marks left in it */
+	gc_concurrent_start();
+	gc_thread_attach();
+	struct obj * kept = &new_pair(0, 0)->hdr;
+	gc_add_root( &kept );
+	gc_collect();
+	gc_concurrent_stop();
+	((struct pair *) kept)->car = &new_pair(0, 0)->hdr;
+	write_barrier(kept);
+	for( i = 0; i < 3; i++ ) {
+		gc_collect();
+		o = ((struct pair *) kept)->car;
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: cycle after stopping freed a pair from a tlab" );
+	}
+	gc_remove_root( &kept );
+	gc_thread_detach();
+
+	/* side table marks: churn through garbage again, with a list kept
+	 * as it goes, once the marks have moved */
+	heap.conservative = 0;
+	heap.side_marks = 1;
+	gc_collect();
+	if (!gc.side)
+		die( 1, "failed: marks didn't move to the side table" );
+
+	struct obj * side = 0;
+	gc_add_root( &side );
+	size_t side_arenas = heap.narenas;
+	for( i = 0; i < 500000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 10 == 0) {
+			p->cdr = side;
+			write_barrier(&p->hdr);
+			side = &p->hdr;
+		}
+		gc_step( 8 );
+	}
+	gc_collect();
+	for( i = 0, o = side; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: side table marks lost a pair" );
+	if (i != 50000)
+		die( 1, "failed: side list has %d cells", i );
+	for( i = 0, o = root; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: side table marks lost an old pair" );
+	if (i != 50000 / 16)
+		die( 1, "failed: old list has %d cells", i );
+	if (heap.narenas > side_arenas + 2 * (50000 * sizeof(struct pair) / ARENA_MAX_OBJ + 1))
+		die( 1, "failed: heap grew from %zu to %zu arenas with side marks",
+			side_arenas, heap.narenas );
+
+	/* paced: a queue of pairs the oldest drop off of, which should take
+	 * a cycle only every so often, without the heap growing. then again
+	 * without gc_step, leaving it all to allocation. */
+	heap.gc_percent = 100;
+	struct obj * queue = &new_pair(0, 0)->hdr;
+	struct pair * qtail = (struct pair *) queue;
+	gc_add_root( &queue );
+	gc_collect();
+	size_t paced_arenas = heap.narenas;
+	unsigned paced_epoch = gc.epoch;
+	for( i = 0; i < 1000000; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		qtail->cdr = &p->hdr;
+		write_barrier(&qtail->hdr);
+		qtail = p;
+		if (i >= 20000) {
+			queue = ((struct pair *) queue)->cdr;
+			gc_root_barrier( &queue );
+		}
+		if (i < 500000)
+			gc_step( 1 );
+		else if (i == 500000)
+			paced_epoch = gc.epoch;
+	}
+	unsigned paced_cycles = gc.epoch - paced_epoch;
+	if (paced_cycles < 3 || paced_cycles > 500)
+		die( 1, "failed: allocation ran %u cycles", paced_cycles );
+	size_t paced_live = gc.marked_bytes > PACE_MIN_LIVE ? gc.marked_bytes : PACE_MIN_LIVE;
+	if (heap.narenas * ARENA_SIZE > 3 * (paced_live + paced_live / 100 * heap.gc_percent))
+		die( 1, "failed: paced heap grew from %zu to %zu arenas",
+			paced_arenas, heap.narenas );
+	for( i = 0, o = queue; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: pacer lost a pair" );
+	if (i != 20001)
+		die( 1, "failed: queue has %d cells", i );
+	gc_remove_root( &queue );
+
+	/* evacuation allocates the copies, which mustn't assist the cycle
+	 * that is making them: keep every 16th pair of a list, each with a
+	 * buf, and empty the arenas they were in */
+	struct obj * sparse = 0;
+	gc_add_root( &sparse );
+	for( round = 0; round < 3; round++ ) {
+		for( i = 0; i < 50000; i++ )
+			sparse = &new_pair(0, sparse)->hdr;
+		for( o = sparse; o; o = ((struct pair *) o)->cdr ) {
+			struct pair * p = (struct pair *) o;
+			struct buf * nb = (struct buf *) heap_alloc(TYPE_BUF, sizeof(struct buf) + 64);
+			nb->len = 64;
+			p->car = &nb->hdr;
+			struct obj * next = p->cdr;
+			int skip;
+			for( skip = 0; skip < 15 && next; skip++ )
+				next = ((struct pair *) next)->cdr;
+			p->cdr = next;
+			write_barrier(o);
+		}
+		heap.evacuate = 100;
+		gc_collect();
+		heap.evacuate = 0;
+
+		for( i = 0, o = sparse; o; o = ((struct pair *) o)->cdr, i++ ) {
+			struct buf * cb = (struct buf *) ((struct pair *) o)->car;
+			if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o))
+					|| o->type != TYPE_PAIR || cb->hdr.type != TYPE_BUF
+					|| cb->len != 64)
+				die( 1, "failed: paced evacuation lost pair %d", i );
+		}
+		if (i != 50000 / 16)
+			die( 1, "failed: evacuated list has %d cells", i );
+		sparse = 0;
+	}
+	gc_remove_root( &sparse );
+	heap.gc_percent = 0;
+
+	printf( "paced: %u cycles for 500000 pairs by assists, %zu arenas grew to %zu\n",
+		paced_cycles, paced_arenas, heap.narenas );
+
+	/* and with mutator threads running against a collector thread,
+	 * which scans their stacks too */
+	heap.conservative = 1;
+	pthread_t mut[MUT_THREADS];
+	struct obj * mut_roots[MUT_THREADS] = { 0 };
+	size_t narenas = heap.narenas;
+	gc_trace_start();
+	heap.scavenge_ms = 1;
+	gc_concurrent_start();
+	for( i = 0; i < MUT_THREADS; i++ )
+		if (pthread_create( &mut[i], 0, mutator, &mut_roots[i] ))
+			die( 1, "failed: start mutator" );
+	for( i = 0; i < MUT_THREADS; i++ )
+		pthread_join( mut[i], 0 );
+	struct obj * conc_weak = mut_roots[0];
+	gc_add_weak( &conc_weak );
+	gc_collect();
+	if (gc_weak_get( &conc_weak ) != mut_roots[0])
+		die( 1, "failed: concurrent cycle cleared a weak slot to a live pair" );
+	gc_remove_weak( &conc_weak );
+
+	/* the collector scavenges between cycles, here on its timer */
+	gc_memory_pressure();
+	while (__atomic_load_n( &scav.pressure, __ATOMIC_RELAXED ))
+		usleep( 1000 );
+
+	for( i = 0; i < MUT_THREADS; i++ ) {
+		int n = 0;
+		for( o = mut_roots[i]; o; o = ((struct pair *) o)->cdr, n++ ) {
+			struct obj * car = ((struct pair *) o)->car;
+			if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o))
+					|| (car && !IS_USED(get_arena(car), CELL_OF(get_arena(car), car))))
+				die( 1, "failed: concurrent mark lost a live pair" );
+		}
+		if (n != MUT_PAIRS / 10)
+			die( 1, "failed: mutator %d list has %d cells", i, n );
+	}
+	gc_concurrent_stop();
+	heap.conservative = 0;
+	heap.scavenge_ms = 0;
+	printf( "concurrent: %zu arenas grew to %zu, %u cycles\n",
+		narenas, heap.narenas, conc.cycles );
+
+	/* a snapshot goes back where it was written from, if that is free.
+	 * with nothing else live, a list of every other pair is mapped in
+	 * somewhere else, and a snapshot of that copy goes back into its
+	 * arena once the arena is given back. the holes in it shouldn't get
+	 * free lists, which would be written into them. */
+	gc_remove_root( &root );
+	struct obj * placed = 0;
+	gc_add_root( &placed );
+	for( i = 0; i < 64; i++ ) {
+		struct pair * p = new_pair(0, 0);
+		if (i % 2 == 0) {
+			p->cdr = placed;
+			write_barrier(&p->hdr);
+			placed = &p->hdr;
+			gc_root_barrier( &placed );
+		}
+	}
+	/* which is written where it is, even if cycles would move it */
+	FILE * img3 = tmpfile();
+	struct obj * before = placed;
+	heap.evacuate = 100;
+	if (!img3 || gc_snapshot_write(img3, placed))
+		die( 1, "failed: write snapshot to move" );
+	heap.evacuate = 0;
+	if (placed != before)
+		die( 1, "failed: writing a snapshot moved its root" );
+	placed = gc_snapshot_map(img3);
+	fclose( img3 );
+	if (!placed || !get_arena(placed)->c.mapped)
+		die( 1, "failed: snapshot to move mapped to %p", (void *) placed );
+	gc_root_barrier( &placed );
+	img3 = tmpfile();
+	if (!img3 || gc_snapshot_write(img3, placed))
+		die( 1, "failed: write snapshot to put back" );
+	struct obj * was = placed;
+	placed = 0;
+	heap.evacuate = 100;
+	gc_collect();
+	heap.evacuate = 0;
+
+	/* a snapshot that is cut short, or says it has more arenas than it
+	 * does, or has them out of place, or one of whose headers is wrong,
+	 * doesn't map */
+	int fd3 = fileno(img3);
+	struct snapshot_hdr sh;
+	struct snapshot_arena se;
+	struct stat sst;
+	enum arena_kind bad_kind = 7, sk;
+	size_t kind_off;
+	if (pread( fd3, &sh, sizeof(sh), 0 ) != sizeof(sh)
+			|| pread( fd3, &se, sizeof(se), sizeof(sh) ) != sizeof(se)
+			|| fstat( fd3, &sst ))
+		die( 1, "failed: read snapshot back" );
+	kind_off = se.off + offsetof(struct arena, c) + offsetof(struct arena_meta_c, kind);
+	if (pread( fd3, &sk, sizeof(sk), kind_off ) != sizeof(sk))
+		die( 1, "failed: read snapshot back" );
+	struct snapshot_hdr bad_hdr = sh;
+	bad_hdr.n = (size_t) 1 << 60;
+	struct snapshot_arena bad_at = se;
+	bad_at.at += ALLOC_UNIT;
+	struct { void * p; size_t len, off; } bad[] = {
+		{ &bad_hdr, sizeof(sh), 0 },
+		{ &bad_at, sizeof(se), sizeof(sh) },
+		{ &bad_kind, sizeof(sk), kind_off },
+	};
+	void * good[] = { &sh, &se, &sk };
+	for( i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++ ) {
+		if (pwrite( fd3, bad[i].p, bad[i].len, bad[i].off ) != (ssize_t) bad[i].len)
+			die( 1, "failed: break snapshot" );
+		if (gc_snapshot_map(img3))
+			die( 1, "failed: broken snapshot %d mapped", i );
+		if (pwrite( fd3, good[i], bad[i].len, bad[i].off ) != (ssize_t) bad[i].len)
+			die( 1, "failed: mend snapshot" );
+	}
+	if (ftruncate( fd3, sst.st_size - 1 ) || gc_snapshot_map(img3))
+		die( 1, "failed: cut short snapshot mapped" );
+	if (ftruncate( fd3, sst.st_size ))
+		die( 1, "failed: mend snapshot" );
+
+	int classes = heap.size_classes;
+	heap.size_classes = 1;
+	placed = gc_snapshot_map(img3);
+	fclose( img3 );
+	if (placed != was)
+		die( 1, "failed: snapshot went to %p, not back to %p", (void *) placed, (void *) was );
+	if (!get_arena(placed)->c.mapped || get_arena(placed)->c.flmask)
+		die( 1, "failed: snapshot put back got free lists" );
+	heap.size_classes = classes;
+	gc_collect();
+	for( i = 0, o = placed; o; o = ((struct pair *) o)->cdr, i++ )
+		if (!IS_USED(get_arena(o), CELL_OF(get_arena(o), o)))
+			die( 1, "failed: snapshot put back lost a pair" );
+	if (i != 32)
+		die( 1, "failed: snapshot put back has %d pairs", i );
+	gc_remove_root( &placed );
+	gc_collect();
+
+	/* everything above should have been counted, and the concurrent
+	 * cycles traced */
+	struct gc_stats last, total;
+	FILE * trace = tmpfile();
+	if (!trace)
+		die( 1, "failed: tmpfile" );
+	int traced = gc_trace_write(trace);
+	long trace_len = ftell(trace);
+	fclose(trace);
+	gc_get_stats(&last, &total);
+	if (GC_STATS) {
+		if (traced || trace_len < 100)
+			die( 1, "failed: trace is %ld bytes", trace_len );
+		if (!total.marked || !total.swept || !total.freed_bytes
+				|| !(total.gs_malloc + total.gs_reused) || !total.barrier_calls
+				|| !total.minors || !total.span_ns[SPAN_STOPPED])
+			die( 1, "failed: stats missed something" );
+		if (total.cycles < conc.cycles || last.max_pause_ns > total.max_pause_ns)
+			die( 1, "failed: stats have %u cycles of %u", total.cycles, conc.cycles );
+		printf( "stats: %u cycles, %zu marked, %zu freed bytes, "
+			"max pause %.3fms, trace %ld bytes\n",
+			total.cycles, total.marked, total.freed_bytes,
+			total.max_pause_ns / 1e6, trace_len );
+	}
 
+	/* the pool's head is tagged, so leak checkers can't see what's in it */
+	gs_trim(0);
 	return 0;
 }